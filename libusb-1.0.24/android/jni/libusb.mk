@@ -34,6 +34,7 @@ LOCAL_SRC_FILES := \
   $(LIBUSB_ROOT_REL)/libusb/os/linux_usbfs.c \
   $(LIBUSB_ROOT_REL)/libusb/os/events_posix.c \
   $(LIBUSB_ROOT_REL)/libusb/os/threads_posix.c \
+  $(LIBUSB_ROOT_REL)/libusb/os/loopback_usb.c \
   $(LIBUSB_ROOT_REL)/libusb/os/linux_netlink.c
 
 LOCAL_C_INCLUDES += \
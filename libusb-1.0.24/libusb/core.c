@@ -27,6 +27,7 @@
 #ifdef __ANDROID__
 #include <android/log.h>
 #endif
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #ifdef HAVE_SYSLOG
@@ -43,10 +44,20 @@ static struct timespec timestamp_origin;
 #if defined(ENABLE_LOGGING) && !defined(USE_SYSTEM_LOGGING_FACILITY)
 static libusb_log_cb log_handler;
 #endif
+#ifdef ENABLE_LOGGING
+/* anything may be logged until the first context has read LIBUSB_DEBUG */
+usbi_atomic_t usbi_log_level_max = LIBUSB_LOG_LEVEL_DEBUG;
+#endif
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+static usbi_mutex_static_t log_level_lock = USBI_MUTEX_INITIALIZER;
+static int log_level_max_known;
+#endif
 
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
 
+const struct usbi_os_backend *usbi_active_backend = &usbi_backend;
+
 /**
  * \mainpage libusb-1.0 API Reference
  *
@@ -362,8 +373,13 @@ if (cfg != desired)
   * - libusb_alloc_streams()
   * - libusb_alloc_transfer()
   * - libusb_attach_kernel_driver()
+  * - libusb_buffer_pool_create()
+  * - libusb_buffer_pool_destroy()
+  * - libusb_buffer_pool_get()
+  * - libusb_buffer_pool_put()
   * - libusb_bulk_transfer()
   * - libusb_cancel_transfer()
+  * - libusb_cancel_transfers()
   * - libusb_claim_interface()
   * - libusb_clear_halt()
   * - libusb_close()
@@ -407,6 +423,7 @@ if (cfg != desired)
   * - libusb_get_device_descriptor()
   * - libusb_get_device_list()
   * - libusb_get_device_speed()
+  * - libusb_get_endpoint_stats()
   * - libusb_get_iso_packet_buffer()
   * - libusb_get_iso_packet_buffer_simple()
   * - libusb_get_max_iso_packet_size()
@@ -423,6 +440,7 @@ if (cfg != desired)
   * - libusb_get_string_descriptor_ascii()
   * - libusb_get_usb_2_0_extension_descriptor()
   * - libusb_get_version()
+  * - libusb_handle_device_events_timeout()
   * - libusb_handle_events()
   * - libusb_handle_events_completed()
   * - libusb_handle_events_locked()
@@ -437,24 +455,35 @@ if (cfg != desired)
   * - libusb_kernel_driver_active()
   * - libusb_lock_events()
   * - libusb_lock_event_waiters()
+  * - libusb_loopback_add_device()
+  * - libusb_loopback_disconnect()
+  * - libusb_loopback_inject_error()
   * - libusb_open()
+  * - libusb_open_device_with_ids()
   * - libusb_open_device_with_vid_pid()
   * - libusb_pollfds_handle_timeouts()
   * - libusb_ref_device()
   * - libusb_release_interface()
   * - libusb_reset_device()
+  * - libusb_reset_endpoint_stats()
   * - libusb_set_auto_detach_kernel_driver()
   * - libusb_set_configuration()
   * - libusb_set_debug()
+  * - libusb_set_dedicated_event_handling()
   * - libusb_set_log_cb()
   * - libusb_set_interface_alt_setting()
   * - libusb_set_iso_packet_lengths()
   * - libusb_set_option()
   * - libusb_setlocale()
   * - libusb_set_pollfd_notifiers()
+  * - libusb_stream_close()
+  * - libusb_stream_open()
+  * - libusb_stream_release_buffer()
   * - libusb_strerror()
   * - libusb_submit_transfer()
+  * - libusb_submit_transfers()
   * - libusb_transfer_get_stream_id()
+  * - libusb_transfer_set_bulk_iov()
   * - libusb_transfer_set_stream_id()
   * - libusb_try_lock_events()
   * - libusb_unlock_events()
@@ -466,6 +495,8 @@ if (cfg != desired)
   * \section Structures
   * - libusb_bos_descriptor
   * - libusb_bos_dev_capability_descriptor
+  * - \ref libusb_buffer_pool
+  * - libusb_bulk_iovec
   * - libusb_config_descriptor
   * - libusb_container_id_descriptor
   * - \ref libusb_context
@@ -473,13 +504,18 @@ if (cfg != desired)
   * - \ref libusb_device
   * - libusb_device_descriptor
   * - \ref libusb_device_handle
+  * - libusb_device_id
   * - libusb_endpoint_descriptor
+  * - libusb_endpoint_stats
   * - libusb_interface
   * - libusb_interface_descriptor
   * - libusb_iso_packet_descriptor
+  * - libusb_loopback_device
+  * - libusb_loopback_endpoint
   * - libusb_pollfd
   * - libusb_ss_endpoint_companion_descriptor
   * - libusb_ss_usb_device_capability_descriptor
+  * - \ref libusb_stream
   * - libusb_transfer
   * - libusb_usb_2_0_extension_descriptor
   * - libusb_version
@@ -698,7 +734,7 @@ struct discovered_devs *discovered_devs_append(
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id)
 {
-	size_t priv_size = usbi_backend.device_priv_size;
+	size_t priv_size = usbi_active_backend->device_priv_size;
 	struct libusb_device *dev = calloc(1, PTR_ALIGN(sizeof(*dev)) + priv_size);
 
 	if (!dev)
@@ -710,6 +746,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	dev->refcnt = 1;
 	dev->session_data = session_id;
 	dev->speed = LIBUSB_SPEED_UNKNOWN;
+	list_init(&dev->id_hash_list);
 
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_connect_device (dev);
@@ -718,15 +755,40 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
+/* Maps a key to its bucket in one of the context's device indexes. Keys
+ * are often small or sparse (bus and address on Linux), so the bits are
+ * mixed before they are reduced. */
+static unsigned int dev_hash(unsigned long key)
+{
+	uint32_t h = (uint32_t)key;
+
+#if ULONG_MAX > UINT32_MAX
+	h ^= (uint32_t)(key >> 32);
+#endif
+	return (h * 0x9e3779b1U) >> (32 - USBI_DEV_HASH_BITS);
+}
+
+static unsigned int id_hash(uint16_t vendor_id, uint16_t product_id)
+{
+	return dev_hash((unsigned long)vendor_id << 16 | product_id);
+}
+
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 
 	dev->attached = 1;
 
-	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
-	list_add(&dev->list, &dev->ctx->usb_devs);
-	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_add(&dev->list, &ctx->usb_devs);
+	list_add(&dev->hash_list,
+		&ctx->usb_devs_hash[dev_hash(dev->session_data)]);
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		list_add(&dev->id_hash_list,
+			&ctx->usb_devs_id_hash[id_hash(dev->device_descriptor.idVendor,
+				dev->device_descriptor.idProduct)]);
+	ctx->num_usb_devs++;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
@@ -746,6 +808,9 @@ void usbi_disconnect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->hash_list);
+	list_del(&dev->id_hash_list);
+	ctx->num_usb_devs--;
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
@@ -781,17 +846,17 @@ int usbi_sanitize_device(struct libusb_device *dev)
 	return 0;
 }
 
-/* Examine libusb's internal list of known devices, looking for one with
- * a specific session ID. Returns the matching device if it was found, and
- * NULL otherwise. */
+/* Look up a device with a specific session ID in libusb's index of known
+ * devices. Returns the matching device if it was found, and NULL otherwise. */
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id)
 {
+	struct list_head *bucket = &ctx->usb_devs_hash[dev_hash(session_id)];
 	struct libusb_device *dev;
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	for_each_device(ctx, dev) {
+	list_for_each_entry(dev, bucket, hash_list, struct libusb_device) {
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -825,40 +890,46 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list)
 {
-	struct discovered_devs *discdevs = discovered_devs_alloc();
+	struct discovered_devs *discdevs;
 	struct libusb_device **ret;
 	int r = 0;
 	ssize_t i, len;
 
 	usbi_dbg(" ");
 
-	if (!discdevs)
-		return LIBUSB_ERROR_NO_MEM;
-
 	ctx = usbi_get_context(ctx);
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
-		/* backend provides hotplug support */
+		/* backend provides hotplug support, so the context's device list
+		 * is kept current by hotplug events and only needs to be copied */
 		struct libusb_device *dev;
 
-		if (usbi_backend.hotplug_poll)
-			usbi_backend.hotplug_poll();
+		if (usbi_active_backend->hotplug_poll)
+			usbi_active_backend->hotplug_poll();
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
-		for_each_device(ctx, dev) {
-			discdevs = discovered_devs_append(discdevs, dev);
-
-			if (!discdevs) {
-				r = LIBUSB_ERROR_NO_MEM;
-				break;
-			}
+		len = (ssize_t)ctx->num_usb_devs;
+		ret = calloc((size_t)len + 1, sizeof(struct libusb_device *));
+		if (ret) {
+			i = 0;
+			for_each_device(ctx, dev)
+				ret[i++] = libusb_ref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
-	} else {
-		/* backend does not provide hotplug support */
-		r = usbi_backend.get_device_list(ctx, &discdevs);
+
+		if (!ret)
+			return LIBUSB_ERROR_NO_MEM;
+
+		*list = ret;
+		return len;
 	}
 
+	discdevs = discovered_devs_alloc();
+	if (!discdevs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* backend does not provide hotplug support */
+	r = usbi_active_backend->get_device_list(ctx, &discdevs);
 	if (r < 0) {
 		len = r;
 		goto out;
@@ -1200,8 +1271,10 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 
 		libusb_unref_device(dev->parent_dev);
 
-		if (usbi_backend.destroy_device)
-			usbi_backend.destroy_device(dev);
+		if (usbi_active_backend->destroy_device)
+			usbi_active_backend->destroy_device(dev);
+
+		usbi_free_config_cache(dev);
 
 		if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 			/* backend does not support hotplug */
@@ -1248,14 +1321,14 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 	libusb_device_handle **dev_handle)
 {
 	struct libusb_device_handle *_dev_handle;
-	size_t priv_size = usbi_backend.device_handle_priv_size;
+	size_t priv_size = usbi_active_backend->device_handle_priv_size;
 	int r;
 
 	usbi_dbg("wrap_sys_device 0x%" PRIxPTR, (uintptr_t)sys_dev);
 
 	ctx = usbi_get_context(ctx);
 
-	if (!usbi_backend.wrap_sys_device)
+	if (!usbi_active_backend->wrap_sys_device)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
 	_dev_handle = calloc(1, PTR_ALIGN(sizeof(*_dev_handle)) + priv_size);
@@ -1263,11 +1336,14 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->events_lock);
+	list_init(&_dev_handle->flying_transfers);
 
-	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
+	r = usbi_active_backend->wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg("wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_mutex_destroy(&_dev_handle->events_lock);
 		free(_dev_handle);
 		return r;
 	}
@@ -1304,7 +1380,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_device_handle *_dev_handle;
-	size_t priv_size = usbi_backend.device_handle_priv_size;
+	size_t priv_size = usbi_active_backend->device_handle_priv_size;
 	int r;
 	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
 
@@ -1317,14 +1393,17 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->events_lock);
+	list_init(&_dev_handle->flying_transfers);
 
 	_dev_handle->dev = libusb_ref_device(dev);
 
-	r = usbi_backend.open(_dev_handle);
+	r = usbi_active_backend->open(_dev_handle);
 	if (r < 0) {
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_mutex_destroy(&_dev_handle->events_lock);
 		free(_dev_handle);
 		return r;
 	}
@@ -1389,6 +1468,97 @@ out:
 	return dev_handle;
 }
 
+/* Returns a referenced device from the context's idVendor/idProduct index,
+ * or NULL if no such device is attached. */
+static struct libusb_device *get_device_by_ids(struct libusb_context *ctx,
+	uint16_t vendor_id, uint16_t product_id)
+{
+	struct list_head *bucket = &ctx->usb_devs_id_hash[id_hash(vendor_id, product_id)];
+	struct libusb_device *dev;
+	struct libusb_device *ret = NULL;
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_for_each_entry(dev, bucket, id_hash_list, struct libusb_device) {
+		if (dev->device_descriptor.idVendor == vendor_id &&
+		    dev->device_descriptor.idProduct == product_id) {
+			ret = libusb_ref_device(dev);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	return ret;
+}
+
+/** \ingroup libusb_dev
+ * Open the first available device matching one of several
+ * <tt>idVendor</tt>/<tt>idProduct</tt> combinations. The pairs are tried in
+ * order and the first device that can be opened is returned, so \p ids
+ * should be sorted by preference. Like libusb_open_device_with_vid_pid(),
+ * only one device is considered for each pair.
+ *
+ * On platforms with hotplug support, libusb keeps the attached devices
+ * indexed by their IDs, so this is a lookup rather than a traversal of all
+ * devices. Elsewhere it walks the device list once.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param ids the ID pairs to search for, in order of preference
+ * \param num_ids the number of elements in \p ids
+ * \returns a device handle for the first device that could be opened, or
+ * NULL on error or if none of the devices could be found or opened. */
+DEFAULT_VISIBILITY
+libusb_device_handle * LIBUSB_CALL libusb_open_device_with_ids(
+	libusb_context *ctx, const struct libusb_device_id *ids, int num_ids)
+{
+	struct libusb_device **devs = NULL;
+	struct libusb_device *dev;
+	struct libusb_device_handle *dev_handle = NULL;
+	int hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	int i;
+
+	if (!ids || num_ids <= 0)
+		return NULL;
+
+	ctx = usbi_get_context(ctx);
+
+	if (hotplug) {
+		if (usbi_active_backend->hotplug_poll)
+			usbi_active_backend->hotplug_poll();
+	} else if (libusb_get_device_list(ctx, &devs) < 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < num_ids && !dev_handle; i++) {
+		usbi_dbg("looking for %04x:%04x", ids[i].idVendor, ids[i].idProduct);
+
+		if (hotplug) {
+			dev = get_device_by_ids(ctx, ids[i].idVendor, ids[i].idProduct);
+			if (!dev)
+				continue;
+			if (libusb_open(dev, &dev_handle) < 0)
+				dev_handle = NULL;
+			libusb_unref_device(dev);
+		} else {
+			size_t j = 0;
+
+			while ((dev = devs[j++]) != NULL) {
+				if (dev->device_descriptor.idVendor == ids[i].idVendor &&
+				    dev->device_descriptor.idProduct == ids[i].idProduct) {
+					if (libusb_open(dev, &dev_handle) < 0)
+						dev_handle = NULL;
+					break;
+				}
+			}
+		}
+	}
+
+	if (devs)
+		libusb_free_device_list(devs, 1);
+	return dev_handle;
+}
+
 static void do_close(struct libusb_context *ctx,
 	struct libusb_device_handle *dev_handle)
 {
@@ -1399,13 +1569,10 @@ static void do_close(struct libusb_context *ctx,
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	for_each_transfer_safe(ctx, itransfer, tmp) {
+	for_each_handle_transfer_safe(dev_handle, itransfer, tmp) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		usbi_mutex_lock(&itransfer->lock);
 		if (!(itransfer->state_flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
@@ -1422,6 +1589,8 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		list_del(&itransfer->list);
+		list_del(&itransfer->handle_list);
+		usbi_remove_transfer_timeout(ctx, itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1437,9 +1606,11 @@ static void do_close(struct libusb_context *ctx,
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
-	usbi_backend.close(dev_handle);
+	usbi_active_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
+	usbi_mutex_destroy(&dev_handle->events_lock);
+	free(dev_handle->ep_stats);
 	free(dev_handle);
 }
 
@@ -1548,8 +1719,8 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 	uint8_t tmp = 0;
 
 	usbi_dbg(" ");
-	if (usbi_backend.get_configuration)
-		r = usbi_backend.get_configuration(dev_handle, &tmp);
+	if (usbi_active_backend->get_configuration)
+		r = usbi_active_backend->get_configuration(dev_handle, &tmp);
 
 	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
 		usbi_dbg("falling back to control message");
@@ -1633,7 +1804,7 @@ int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev_handle,
 	usbi_dbg("configuration %d", configuration);
 	if (configuration < -1 || configuration > (int)UINT8_MAX)
 		return LIBUSB_ERROR_INVALID_PARAM;
-	return usbi_backend.set_configuration(dev_handle, configuration);
+	return usbi_active_backend->set_configuration(dev_handle, configuration);
 }
 
 /** \ingroup libusb_dev
@@ -1680,7 +1851,7 @@ int API_EXPORTED libusb_claim_interface(libusb_device_handle *dev_handle,
 	if (dev_handle->claimed_interfaces & (1U << interface_number))
 		goto out;
 
-	r = usbi_backend.claim_interface(dev_handle, (uint8_t)interface_number);
+	r = usbi_active_backend->claim_interface(dev_handle, (uint8_t)interface_number);
 	if (r == 0)
 		dev_handle->claimed_interfaces |= 1U << interface_number;
 
@@ -1723,7 +1894,7 @@ int API_EXPORTED libusb_release_interface(libusb_device_handle *dev_handle,
 		goto out;
 	}
 
-	r = usbi_backend.release_interface(dev_handle, (uint8_t)interface_number);
+	r = usbi_active_backend->release_interface(dev_handle, (uint8_t)interface_number);
 	if (r == 0)
 		dev_handle->claimed_interfaces &= ~(1U << interface_number);
 
@@ -1775,7 +1946,7 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev_hand
 	}
 	usbi_mutex_unlock(&dev_handle->lock);
 
-	return usbi_backend.set_interface_altsetting(dev_handle,
+	return usbi_active_backend->set_interface_altsetting(dev_handle,
 		(uint8_t)interface_number, (uint8_t)alternate_setting);
 }
 
@@ -1802,7 +1973,7 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	return usbi_backend.clear_halt(dev_handle, endpoint);
+	return usbi_active_backend->clear_halt(dev_handle, endpoint);
 }
 
 /** \ingroup libusb_dev
@@ -1830,8 +2001,8 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev_handle)
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.reset_device)
-		return usbi_backend.reset_device(dev_handle);
+	if (usbi_active_backend->reset_device)
+		return usbi_active_backend->reset_device(dev_handle);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
@@ -1868,8 +2039,8 @@ int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.alloc_streams)
-		return usbi_backend.alloc_streams(dev_handle, num_streams, endpoints,
+	if (usbi_active_backend->alloc_streams)
+		return usbi_active_backend->alloc_streams(dev_handle, num_streams, endpoints,
 						   num_endpoints);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
@@ -1898,8 +2069,8 @@ int API_EXPORTED libusb_free_streams(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.free_streams)
-		return usbi_backend.free_streams(dev_handle, endpoints,
+	if (usbi_active_backend->free_streams)
+		return usbi_active_backend->free_streams(dev_handle, endpoints,
 						  num_endpoints);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
@@ -1936,8 +2107,8 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 	if (!dev_handle->dev->attached)
 		return NULL;
 
-	if (usbi_backend.dev_mem_alloc)
-		return usbi_backend.dev_mem_alloc(dev_handle, length);
+	if (usbi_active_backend->dev_mem_alloc)
+		return usbi_active_backend->dev_mem_alloc(dev_handle, length);
 	else
 		return NULL;
 }
@@ -1953,8 +2124,8 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length)
 {
-	if (usbi_backend.dev_mem_free)
-		return usbi_backend.dev_mem_free(dev_handle, buffer, length);
+	if (usbi_active_backend->dev_mem_free)
+		return usbi_active_backend->dev_mem_free(dev_handle, buffer, length);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
@@ -1987,8 +2158,8 @@ int API_EXPORTED libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.kernel_driver_active)
-		return usbi_backend.kernel_driver_active(dev_handle, (uint8_t)interface_number);
+	if (usbi_active_backend->kernel_driver_active)
+		return usbi_active_backend->kernel_driver_active(dev_handle, (uint8_t)interface_number);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
@@ -2025,8 +2196,8 @@ int API_EXPORTED libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.detach_kernel_driver)
-		return usbi_backend.detach_kernel_driver(dev_handle, (uint8_t)interface_number);
+	if (usbi_active_backend->detach_kernel_driver)
+		return usbi_active_backend->detach_kernel_driver(dev_handle, (uint8_t)interface_number);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
@@ -2062,8 +2233,8 @@ int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.attach_kernel_driver)
-		return usbi_backend.attach_kernel_driver(dev_handle, (uint8_t)interface_number);
+	if (usbi_active_backend->attach_kernel_driver)
+		return usbi_active_backend->attach_kernel_driver(dev_handle, (uint8_t)interface_number);
 	else
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
@@ -2093,13 +2264,27 @@ int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
 int API_EXPORTED libusb_set_auto_detach_kernel_driver(
 	libusb_device_handle *dev_handle, int enable)
 {
-	if (!(usbi_backend.caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER))
+	if (!(usbi_active_backend->caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER))
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
 	dev_handle->auto_detach_kernel_driver = enable;
 	return LIBUSB_SUCCESS;
 }
 
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+/* Must be called before a context starts logging at a new level. The
+ * maximum is only ever raised, usbi_log() still checks each context's own
+ * level. */
+static void raise_log_level_max(enum libusb_log_level level)
+{
+	usbi_mutex_static_lock(&log_level_lock);
+	if (!log_level_max_known || usbi_atomic_load(&usbi_log_level_max) < (long)level)
+		usbi_atomic_store(&usbi_log_level_max, (long)level);
+	log_level_max_known = 1;
+	usbi_mutex_static_unlock(&log_level_lock);
+}
+#endif
+
 /** \ingroup libusb_lib
  * \deprecated Use libusb_set_option() instead using the
  * \ref LIBUSB_OPTION_LOG_LEVEL option.
@@ -2110,6 +2295,7 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	ctx = usbi_get_context(ctx);
 	if (!ctx->debug_fixed) {
 		level = CLAMP(level, LIBUSB_LOG_LEVEL_NONE, LIBUSB_LOG_LEVEL_DEBUG);
+		raise_log_level_max((enum libusb_log_level)level);
 		ctx->debug = (enum libusb_log_level)level;
 	}
 #else
@@ -2199,16 +2385,35 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 			break;
 		}
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-		if (!ctx->debug_fixed)
+		if (!ctx->debug_fixed) {
+			raise_log_level_max((enum libusb_log_level)arg);
 			ctx->debug = (enum libusb_log_level)arg;
+		}
+#endif
+		break;
+
+	case LIBUSB_OPTION_ENDPOINT_STATS:
+		ctx->endpoint_stats = va_arg(ap, int) != 0;
+		break;
+
+	case LIBUSB_OPTION_BUSY_POLL:
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+		}
+#if defined(PLATFORM_POSIX)
+		ctx->busy_poll_us = (unsigned int)arg;
+#else
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
 #endif
 		break;
 
 	/* Handle all backend-specific options here */
 	case LIBUSB_OPTION_USE_USBDK:
 	case LIBUSB_OPTION_WEAK_AUTHORITY:
-		if (usbi_backend.set_option)
-			r = usbi_backend.set_option(ctx, option, ap);
+		if (usbi_active_backend->set_option)
+			r = usbi_active_backend->set_option(ctx, option, ap);
 		else
 			r = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
@@ -2241,6 +2446,19 @@ static enum libusb_log_level get_env_debug_level(void)
 }
 #endif
 
+/* returns the backend named by the LIBUSB_BACKEND environment variable, or
+ * the platform's backend if LIBUSB_BACKEND is not present or unknown. */
+static const struct usbi_os_backend *get_env_backend(void)
+{
+#ifdef PLATFORM_POSIX
+	const char *name = getenv("LIBUSB_BACKEND");
+
+	if (name && !strcmp(name, "loopback"))
+		return &usbi_loopback_backend;
+#endif
+	return &usbi_backend;
+}
+
 /** \ingroup libusb_lib
  * Initialize libusb. This function must be called before calling any other
  * libusb function.
@@ -2249,6 +2467,12 @@ static enum libusb_log_level get_env_debug_level(void)
  * context will be created. If there was already a default context, it will
  * be reused (and nothing will be initialized/reinitialized).
  *
+ * On POSIX platforms, setting the LIBUSB_BACKEND environment variable to
+ * "loopback" makes libusb use virtual devices instead of the platform's USB
+ * stack, see \ref libusb_loopback. The backend is chosen when no context
+ * exists yet and is shared by all contexts until they have all been
+ * deinitialized.
+ *
  * \param context Optional output location for context pointer.
  * Only valid on return code 0.
  * \returns 0 on success, or a LIBUSB_ERROR code on failure
@@ -2257,7 +2481,8 @@ static enum libusb_log_level get_env_debug_level(void)
 int API_EXPORTED libusb_init(libusb_context **context)
 {
 	struct libusb_device *dev, *next;
-	size_t priv_size = usbi_backend.context_priv_size;
+	size_t priv_size;
+	unsigned int i;
 	struct libusb_context *ctx;
 	static int first_init = 1;
 	int r = 0;
@@ -2274,6 +2499,13 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		return 0;
 	}
 
+	/* contexts cannot mix backends, so only pick one while there are none */
+	usbi_mutex_static_lock(&active_contexts_lock);
+	if (first_init || list_empty(&active_contexts_list))
+		usbi_active_backend = get_env_backend();
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	priv_size = usbi_active_backend->context_priv_size;
 	ctx = calloc(1, PTR_ALIGN(sizeof(*ctx)) + priv_size);
 	if (!ctx) {
 		r = LIBUSB_ERROR_NO_MEM;
@@ -2284,6 +2516,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	ctx->debug = get_env_debug_level();
 	if (ctx->debug != LIBUSB_LOG_LEVEL_NONE)
 		ctx->debug_fixed = 1;
+	raise_log_level_max(ctx->debug);
 #endif
 
 	/* default context should be initialized before calling usbi_dbg */
@@ -2295,11 +2528,16 @@ int API_EXPORTED libusb_init(libusb_context **context)
 
 	usbi_dbg("libusb v%u.%u.%u.%u%s", libusb_version_internal.major, libusb_version_internal.minor,
 		libusb_version_internal.micro, libusb_version_internal.nano, libusb_version_internal.rc);
+	usbi_dbg("using %s backend", usbi_active_backend->name);
 
 	usbi_mutex_init(&ctx->usb_devs_lock);
 	usbi_mutex_init(&ctx->open_devs_lock);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock);
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_DEV_HASH_SIZE; i++) {
+		list_init(&ctx->usb_devs_hash[i]);
+		list_init(&ctx->usb_devs_id_hash[i]);
+	}
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
 	ctx->next_hotplug_cb_handle = 1;
@@ -2312,8 +2550,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	list_add (&ctx->list, &active_contexts_list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
-	if (usbi_backend.init) {
-		r = usbi_backend.init(ctx);
+	if (usbi_active_backend->init) {
+		r = usbi_active_backend->init(ctx);
 		if (r)
 			goto err_free_ctx;
 	}
@@ -2330,8 +2568,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	return 0;
 
 err_backend_exit:
-	if (usbi_backend.exit)
-		usbi_backend.exit(ctx);
+	if (usbi_active_backend->exit)
+		usbi_active_backend->exit(ctx);
 err_free_ctx:
 	if (ctx == usbi_default_context) {
 		usbi_default_context = NULL;
@@ -2345,6 +2583,8 @@ err_free_ctx:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	for_each_device_safe(ctx, dev, next) {
 		list_del(&dev->list);
+		list_del(&dev->hash_list);
+		list_del(&dev->id_hash_list);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -2405,6 +2645,8 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del(&ctx->list);
+	if (list_empty(&active_contexts_list))
+		usbi_transfer_pool_drain();
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
@@ -2425,6 +2667,8 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		for_each_device_safe(ctx, dev, next) {
 			list_del(&dev->list);
+			list_del(&dev->hash_list);
+			list_del(&dev->id_hash_list);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -2438,8 +2682,8 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 		usbi_warn(ctx, "application left some devices open");
 
 	usbi_io_exit(ctx);
-	if (usbi_backend.exit)
-		usbi_backend.exit(ctx);
+	if (usbi_active_backend->exit)
+		usbi_active_backend->exit(ctx);
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
@@ -2466,11 +2710,11 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 	case LIBUSB_CAP_HAS_CAPABILITY:
 		return 1;
 	case LIBUSB_CAP_HAS_HOTPLUG:
-		return !(usbi_backend.get_device_list);
+		return !(usbi_active_backend->get_device_list);
 	case LIBUSB_CAP_HAS_HID_ACCESS:
-		return (usbi_backend.caps & USBI_CAP_HAS_HID_ACCESS);
+		return (usbi_active_backend->caps & USBI_CAP_HAS_HID_ACCESS);
 	case LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER:
-		return (usbi_backend.caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER);
+		return (usbi_active_backend->caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER);
 	}
 	return 0;
 }
@@ -455,32 +455,219 @@ err:
 	return r;
 }
 
+/* A parsed configuration handed out to applications lives in a single
+ * allocation together with all the interfaces, endpoints and extra
+ * descriptors it points to. It is read-only once built, so the device's
+ * cache and any number of callers share it through the reference count. */
+struct config_arena {
+	usbi_atomic_t refcnt;
+	struct libusb_config_descriptor config;
+};
+
+#define CONFIG_TO_ARENA(config) \
+	container_of(config, struct config_arena, config)
+
+static const unsigned char *arena_copy_extra(uint8_t **pos,
+	const unsigned char *extra, int length)
+{
+	const unsigned char *ret = *pos;
+
+	if (!length)
+		return NULL;
+
+	memcpy(*pos, extra, (size_t)length);
+	*pos += length;
+	return ret;
+}
+
+/* Copies a configuration built by parse_configuration() into a new arena
+ * with a reference count of 1. All structures are laid out first, so they
+ * stay pointer-aligned, followed by the extra descriptor bytes. */
+static struct libusb_config_descriptor *config_to_arena(
+	const struct libusb_config_descriptor *src)
+{
+	struct config_arena *arena;
+	struct libusb_config_descriptor *config;
+	struct libusb_interface *usb_interface;
+	size_t size = sizeof(*arena);
+	size_t extra_size = (size_t)src->extra_length;
+	uint8_t *pos, *extra_pos;
+	int i, a, e;
+
+	for (i = 0; i < src->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &src->interface[i];
+
+		size += sizeof(*iface);
+		for (a = 0; a < iface->num_altsetting; a++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[a];
+
+			size += sizeof(*alt);
+			size += alt->bNumEndpoints * sizeof(*alt->endpoint);
+			extra_size += (size_t)alt->extra_length;
+			for (e = 0; e < alt->bNumEndpoints; e++)
+				extra_size += (size_t)alt->endpoint[e].extra_length;
+		}
+	}
+
+	arena = malloc(size + extra_size);
+	if (!arena)
+		return NULL;
+
+	arena->refcnt = 1;
+	pos = (uint8_t *)(arena + 1);
+	extra_pos = (uint8_t *)arena + size;
+
+	config = &arena->config;
+	*config = *src;
+	config->extra = arena_copy_extra(&extra_pos, src->extra, src->extra_length);
+
+	usb_interface = (struct libusb_interface *)pos;
+	pos += src->bNumInterfaces * sizeof(*usb_interface);
+	config->interface = usb_interface;
+
+	for (i = 0; i < src->bNumInterfaces; i++) {
+		const struct libusb_interface *src_iface = &src->interface[i];
+		struct libusb_interface_descriptor *altsetting;
+
+		altsetting = (struct libusb_interface_descriptor *)pos;
+		pos += src_iface->num_altsetting * sizeof(*altsetting);
+		usb_interface[i].altsetting = altsetting;
+		usb_interface[i].num_altsetting = src_iface->num_altsetting;
+
+		for (a = 0; a < src_iface->num_altsetting; a++) {
+			const struct libusb_interface_descriptor *src_alt = &src_iface->altsetting[a];
+			struct libusb_endpoint_descriptor *endpoint = NULL;
+
+			altsetting[a] = *src_alt;
+			altsetting[a].extra = arena_copy_extra(&extra_pos,
+				src_alt->extra, src_alt->extra_length);
+
+			if (src_alt->bNumEndpoints) {
+				endpoint = (struct libusb_endpoint_descriptor *)pos;
+				pos += src_alt->bNumEndpoints * sizeof(*endpoint);
+			}
+			altsetting[a].endpoint = endpoint;
+
+			for (e = 0; e < src_alt->bNumEndpoints; e++) {
+				endpoint[e] = src_alt->endpoint[e];
+				endpoint[e].extra = arena_copy_extra(&extra_pos,
+					src_alt->endpoint[e].extra,
+					src_alt->endpoint[e].extra_length);
+			}
+		}
+	}
+
+	return config;
+}
+
 static int raw_desc_to_config(struct libusb_context *ctx,
 	const uint8_t *buf, int size, struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = calloc(1, sizeof(*_config));
+	struct libusb_config_descriptor _config;
 	int r;
 
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = parse_configuration(ctx, _config, buf, size);
+	memset(&_config, 0, sizeof(_config));
+	r = parse_configuration(ctx, &_config, buf, size);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
 
-	*config = _config;
-	return LIBUSB_SUCCESS;
+	*config = config_to_arena(&_config);
+	clear_configuration(&_config);
+
+	return *config ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+}
+
+static struct libusb_config_descriptor *ref_config(
+	struct libusb_config_descriptor *config)
+{
+	usbi_atomic_inc(&CONFIG_TO_ARENA(config)->refcnt);
+	return config;
+}
+
+/* Looks a configuration up in the device's cache. Must be called with the
+ * device lock held. A wTotalLength of 0 matches any length. */
+static struct libusb_config_descriptor *find_cached_config(
+	struct libusb_device *dev, uint8_t bConfigurationValue,
+	uint16_t wTotalLength)
+{
+	struct libusb_config_descriptor *config;
+	uint8_t idx;
+
+	for (idx = 0; idx < USB_MAXCONFIG; idx++) {
+		config = dev->config_cache[idx];
+		if (!config)
+			break;
+		if (config->bConfigurationValue == bConfigurationValue &&
+		    (!wTotalLength || config->wTotalLength == wTotalLength))
+			return config;
+	}
+
+	return NULL;
+}
+
+/* Returns a new reference to a cached configuration, or NULL if it has not
+ * been parsed yet. */
+static struct libusb_config_descriptor *get_cached_config(
+	struct libusb_device *dev, uint8_t bConfigurationValue,
+	uint16_t wTotalLength)
+{
+	struct libusb_config_descriptor *config;
+
+	usbi_mutex_lock(&dev->lock);
+	config = find_cached_config(dev, bConfigurationValue, wTotalLength);
+	if (config)
+		ref_config(config);
+	usbi_mutex_unlock(&dev->lock);
+
+	return config;
+}
+
+/* Stores a freshly parsed configuration in the cache and returns the
+ * caller's reference to the cached copy, which may be one that another
+ * thread stored first. */
+static struct libusb_config_descriptor *cache_config(struct libusb_device *dev,
+	struct libusb_config_descriptor *config)
+{
+	struct libusb_config_descriptor *cached;
+	uint8_t idx;
+
+	usbi_mutex_lock(&dev->lock);
+	cached = find_cached_config(dev, config->bConfigurationValue,
+		config->wTotalLength);
+	if (cached) {
+		libusb_free_config_descriptor(config);
+		config = ref_config(cached);
+	} else {
+		for (idx = 0; idx < USB_MAXCONFIG; idx++) {
+			if (!dev->config_cache[idx]) {
+				dev->config_cache[idx] = ref_config(config);
+				break;
+			}
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	return config;
+}
+
+void usbi_free_config_cache(struct libusb_device *dev)
+{
+	uint8_t idx;
+
+	for (idx = 0; idx < USB_MAXCONFIG; idx++) {
+		libusb_free_config_descriptor(dev->config_cache[idx]);
+		dev->config_cache[idx] = NULL;
+	}
 }
 
 static int get_active_config_descriptor(struct libusb_device *dev,
 	uint8_t *buffer, size_t size)
 {
-	int r = usbi_backend.get_active_config_descriptor(dev, buffer, size);
+	int r = usbi_active_backend->get_active_config_descriptor(dev, buffer, size);
 
 	if (r < 0)
 		return r;
@@ -500,7 +687,7 @@ static int get_active_config_descriptor(struct libusb_device *dev,
 static int get_config_descriptor(struct libusb_device *dev, uint8_t config_idx,
 	uint8_t *buffer, size_t size)
 {
-	int r = usbi_backend.get_config_descriptor(dev, config_idx, buffer, size);
+	int r = usbi_active_backend->get_config_descriptor(dev, config_idx, buffer, size);
 
 	if (r < 0)
 		return r;
@@ -543,6 +730,9 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The descriptor is shared with the device's cache of parsed configurations
+ * and must not be modified, see libusb_get_config_descriptor().
+ *
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
@@ -564,7 +754,13 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	if (r < 0)
 		return r;
 
+	/* the header identifies the configuration, which is then normally
+	 * served from the cache; otherwise the active descriptor is parsed */
 	config_len = libusb_le16_to_cpu(_config.desc.wTotalLength);
+	*config = get_cached_config(dev, _config.desc.bConfigurationValue, config_len);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	buf = malloc(config_len);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -574,6 +770,9 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
 
 	free(buf);
+
+	if (r == LIBUSB_SUCCESS)
+		*config = cache_config(dev, *config);
 	return r;
 }
 
@@ -582,6 +781,12 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * Each configuration is parsed once per device. Later calls, including
+ * those of libusb_get_active_config_descriptor(),
+ * libusb_get_config_descriptor_by_value() and libusb_get_max_packet_size(),
+ * return a new reference to the same read-only descriptor, which must not
+ * be modified.
+ *
  * \param dev a device
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
@@ -610,6 +815,10 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		return r;
 
 	config_len = libusb_le16_to_cpu(_config.desc.wTotalLength);
+	*config = get_cached_config(dev, _config.desc.bConfigurationValue, config_len);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	buf = malloc(config_len);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -619,6 +828,9 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
 
 	free(buf);
+
+	if (r == LIBUSB_SUCCESS)
+		*config = cache_config(dev, *config);
 	return r;
 }
 
@@ -645,15 +857,22 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t idx;
 	int r;
 
-	if (usbi_backend.get_config_descriptor_by_value) {
+	*config = get_cached_config(dev, bConfigurationValue, 0);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
+	if (usbi_active_backend->get_config_descriptor_by_value) {
 		void *buf;
 
-		r = usbi_backend.get_config_descriptor_by_value(dev,
+		r = usbi_active_backend->get_config_descriptor_by_value(dev,
 			bConfigurationValue, &buf);
 		if (r < 0)
 			return r;
 
-		return raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+		if (r == LIBUSB_SUCCESS)
+			*config = cache_config(dev, *config);
+		return r;
 	}
 
 	usbi_dbg("value %u", bConfigurationValue);
@@ -677,16 +896,22 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * Since configuration descriptors are shared, this drops the reference
+ * that was handed out and the memory is released with the last one.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config)
 {
+	struct config_arena *arena;
+
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	arena = CONFIG_TO_ARENA(config);
+	if (usbi_atomic_dec(&arena->refcnt) == 0)
+		free(arena);
 }
 
 /** \ingroup libusb_desc
@@ -24,6 +24,13 @@
 #include "libusbi.h"
 #include "hotplug.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#if defined(PLATFORM_POSIX)
+#include <sys/mman.h>
+#endif
+
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
  *
@@ -1170,10 +1177,14 @@ int usbi_io_init(struct libusb_context *ctx)
 	list_init(&ctx->hotplug_msgs);
 	list_init(&ctx->completed_transfers);
 
-	r = usbi_create_event(&ctx->event);
+	r = usbi_init_event_data(ctx);
 	if (r < 0)
 		goto err;
 
+	r = usbi_create_event(&ctx->event);
+	if (r < 0)
+		goto err_free_event_data;
+
 	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS);
 	if (r < 0)
 		goto err_destroy_event;
@@ -1199,6 +1210,8 @@ err_destroy_timer:
 #endif
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
+err_free_event_data:
+	usbi_free_event_data(ctx);
 err:
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
@@ -1236,7 +1249,8 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
 	cleanup_removed_event_sources(ctx);
-	free(ctx->event_data);
+	free(ctx->timeout_heap);
+	usbi_free_event_data(ctx);
 }
 
 static void calculate_timeout(struct usbi_transfer *itransfer)
@@ -1259,6 +1273,28 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 	}
 }
 
+/* Freed non-isochronous transfers waiting to be reused, linked through their
+ * first word. All of them are transfer_pool_block_size bytes long, which
+ * depends on the backend the transfers were allocated for; 0 while no
+ * transfers are to be kept, i.e. after the last context went away. */
+#define TRANSFER_POOL_MAX	64
+static usbi_mutex_static_t transfer_pool_lock = USBI_MUTEX_INITIALIZER;
+static void *transfer_pool;
+static unsigned int transfer_pool_count;
+static size_t transfer_pool_block_size;
+
+static void transfer_pool_drain_locked(void)
+{
+	void *ptr;
+
+	while (transfer_pool) {
+		ptr = transfer_pool;
+		transfer_pool = *(void **)ptr;
+		free(ptr);
+	}
+	transfer_pool_count = 0;
+}
+
 /** \ingroup libusb_asyncio
  * Allocate a libusb transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1279,6 +1315,10 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
  * use it on a non-isochronous endpoint. If you do this, ensure that at time
  * of submission, num_iso_packets is 0 and that type is set appropriately.
  *
+ * Transfers without isochronous packets are recycled: libusb keeps a small
+ * number of freed ones around and hands them out again here, so that a
+ * steady stream of allocate/submit/free cycles does not hit the allocator.
+ *
  * \param iso_packets number of isochronous packet descriptors to allocate. Must be non-negative.
  * \returns a newly allocated transfer, or NULL on error
  */
@@ -1288,7 +1328,7 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 {
 	size_t priv_size;
 	size_t alloc_size;
-	unsigned char *ptr;
+	unsigned char *ptr = NULL;
 	struct usbi_transfer *itransfer;
 	struct libusb_transfer *transfer;
 
@@ -1296,12 +1336,31 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	if (iso_packets < 0)
 		return NULL;
 
-	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+	priv_size = PTR_ALIGN(usbi_active_backend->transfer_priv_size);
 	alloc_size = priv_size
 		+ sizeof(struct usbi_transfer)
 		+ sizeof(struct libusb_transfer)
 		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
-	ptr = calloc(1, alloc_size);
+
+	if (iso_packets == 0) {
+		usbi_mutex_static_lock(&transfer_pool_lock);
+		if (transfer_pool_block_size != alloc_size) {
+			/* libusb_init() switched backends, the pooled transfers
+			 * are sized for the previous one */
+			transfer_pool_drain_locked();
+			transfer_pool_block_size = alloc_size;
+		} else if (transfer_pool) {
+			ptr = transfer_pool;
+			transfer_pool = *(void **)ptr;
+			transfer_pool_count--;
+		}
+		usbi_mutex_static_unlock(&transfer_pool_lock);
+	}
+
+	if (ptr)
+		memset(ptr, 0, alloc_size);
+	else
+		ptr = calloc(1, alloc_size);
 	if (!ptr)
 		return NULL;
 
@@ -1347,18 +1406,188 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
 	usbi_mutex_destroy(&itransfer->lock);
 
-	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
-	ptr = (unsigned char *)itransfer - priv_size;
-	assert(ptr == itransfer->priv);
+	/* the active backend may have changed since the transfer was
+	 * allocated, so its layout is taken from the transfer itself */
+	ptr = itransfer->priv;
+	priv_size = (size_t)((unsigned char *)itransfer - ptr);
+
+	if (itransfer->num_iso_packets == 0) {
+		usbi_mutex_static_lock(&transfer_pool_lock);
+		if (transfer_pool_count < TRANSFER_POOL_MAX &&
+		    transfer_pool_block_size == priv_size
+				+ sizeof(struct usbi_transfer)
+				+ sizeof(struct libusb_transfer)) {
+			*(void **)ptr = transfer_pool;
+			transfer_pool = ptr;
+			transfer_pool_count++;
+			ptr = NULL;
+		}
+		usbi_mutex_static_unlock(&transfer_pool_lock);
+	}
+
 	free(ptr);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
+/* Release the transfers cached by libusb_free_transfer(). Called when the
+ * last context goes away. */
+void usbi_transfer_pool_drain(void)
+{
+	usbi_mutex_static_lock(&transfer_pool_lock);
+	transfer_pool_drain_locked();
+	/* until the next allocation, transfers are freed rather than kept */
+	transfer_pool_block_size = 0;
+	usbi_mutex_static_unlock(&transfer_pool_lock);
+}
+
+/* timeout heap maintenance. all of these must be called with the
+ * flying_transfers_lock held. */
+#define TIMEOUT_HEAP_LESS(ctx, a, b) \
+	TIMESPEC_CMP(&(ctx)->timeout_heap[a]->timeout, &(ctx)->timeout_heap[b]->timeout, <)
+
+static void timeout_heap_swap(struct libusb_context *ctx, unsigned int a,
+	unsigned int b)
+{
+	struct usbi_transfer *tmp = ctx->timeout_heap[a];
+
+	ctx->timeout_heap[a] = ctx->timeout_heap[b];
+	ctx->timeout_heap[b] = tmp;
+	ctx->timeout_heap[a]->timeout_heap_index = a + 1;
+	ctx->timeout_heap[b]->timeout_heap_index = b + 1;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, unsigned int i)
+{
+	while (i > 0 && TIMEOUT_HEAP_LESS(ctx, i, (i - 1) / 2)) {
+		timeout_heap_swap(ctx, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int i)
+{
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= ctx->timeout_heap_len)
+			break;
+		if (child + 1 < ctx->timeout_heap_len && TIMEOUT_HEAP_LESS(ctx, child + 1, child))
+			child++;
+		if (!TIMEOUT_HEAP_LESS(ctx, child, i))
+			break;
+		timeout_heap_swap(ctx, i, child);
+		i = child;
+	}
+}
+
+static int timeout_heap_push(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	unsigned int i;
+
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 16;
+		struct usbi_transfer **heap = realloc(ctx->timeout_heap, size * sizeof(*heap));
+
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+
+	i = ctx->timeout_heap_len++;
+	ctx->timeout_heap[i] = itransfer;
+	itransfer->timeout_heap_index = i + 1;
+	timeout_heap_sift_up(ctx, i);
+	return 0;
+}
+
+void usbi_remove_transfer_timeout(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	unsigned int i = itransfer->timeout_heap_index;
+	unsigned int last;
+
+	if (!i)
+		return;
+
+	i--;
+	last = --ctx->timeout_heap_len;
+	itransfer->timeout_heap_index = 0;
+	if (i == last)
+		return;
+
+	ctx->timeout_heap[i] = ctx->timeout_heap[last];
+	ctx->timeout_heap[i]->timeout_heap_index = i + 1;
+	timeout_heap_sift_up(ctx, i);
+	timeout_heap_sift_down(ctx, ctx->timeout_heap[i]->timeout_heap_index - 1);
+}
+
+/* returns the transfer with the earliest pending timeout, or NULL. transfers
+ * whose timeout has been handled or is handled by the OS are dropped from
+ * the heap on the way. */
+static struct usbi_transfer *next_timeout_transfer(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *itransfer = ctx->timeout_heap[0];
+
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+
+		usbi_remove_transfer_timeout(ctx, itransfer);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_OS_TIMER
+/* long timeouts are armed rounded up to a multiple of TIMER_BUCKET_NSEC, so
+ * that transfers submitted close together share a single expiry of the timer.
+ * shorter timeouts, for which the rounding would be noticeable, are armed
+ * exactly. */
+#define TIMER_BUCKET_MIN_TIMEOUT	256U
+#define TIMER_BUCKET_NSEC		(4 * 1000000L)
+
+/* arms the timer to expire no later than the bucket of the given transfer's
+ * timeout. the timer is left alone when it already expires at or before that
+ * bucket, as an early expiry only costs a pass through handle_timer_trigger().
+ * this means that completing the transfer with the earliest timeout never
+ * touches the timer, it simply fires early and is rearmed once for the whole
+ * pass. must be called with flying_list locked.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timer_for_timeout(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	struct timespec bucket = itransfer->timeout;
+	int r;
+
+	if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout >= TIMER_BUCKET_MIN_TIMEOUT) {
+		long rem = bucket.tv_nsec % TIMER_BUCKET_NSEC;
+
+		if (rem) {
+			bucket.tv_nsec += TIMER_BUCKET_NSEC - rem;
+			if (bucket.tv_nsec >= NSEC_PER_SEC) {
+				++bucket.tv_sec;
+				bucket.tv_nsec -= NSEC_PER_SEC;
+			}
+		}
+	}
+
+	if (TIMESPEC_IS_SET(&ctx->timer_deadline) &&
+	    !TIMESPEC_CMP(&bucket, &ctx->timer_deadline, <))
+		return 0;
+
+	r = usbi_arm_timer(&ctx->timer, &bucket);
+	if (r == 0)
+		ctx->timer_deadline = bucket;
+
+	return r;
+}
+
+/* rearms the timer based on the next upcoming timeout, once the timer has
+ * expired. must be called with flying_list locked.
  * returns 0 on success or a LIBUSB_ERROR code on failure.
  */
-#ifdef HAVE_OS_TIMER
 static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 {
 	struct usbi_transfer *itransfer;
@@ -1366,111 +1595,98 @@ static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 	if (!usbi_using_timer(ctx))
 		return 0;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
+	/* an expired timer stays readable until it is set again */
+	TIMESPEC_CLEAR(&ctx->timer_deadline);
 
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			usbi_dbg("next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
-		}
+	itransfer = next_timeout_transfer(ctx);
+	if (itransfer) {
+		usbi_dbg("next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
+		return arm_timer_for_timeout(ctx, itransfer);
 	}
 
 	usbi_dbg("no timeouts, disarming timer");
 	return usbi_disarm_timer(&ctx->timer);
 }
-#else
-static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
+#endif
+
+/* take a transfer off the active transfers lists and the timeout heap.
+ * must be called with flying_list locked. */
+static void unlink_flying_transfer(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
 {
-	UNUSED(ctx);
-	return 0;
+	list_del(&itransfer->list);
+	list_del(&itransfer->handle_list);
+	usbi_remove_transfer_timeout(ctx, itransfer);
 }
-#endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
+/* add a transfer to the active transfers list, and to the timeout heap if
+ * it has a timeout, without touching the timer.
+ * This function will return non 0 if it fails to grow the heap,
  * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+static int add_to_flying_list_unarmed(struct usbi_transfer *itransfer)
 {
-	struct usbi_transfer *cur;
-	struct timespec *timeout = &itransfer->timeout;
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
+	int r;
 
 	calculate_timeout(itransfer);
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
+	if (ctx->endpoint_stats)
+		usbi_get_monotonic_time(&itransfer->submit_time);
+	else
+		TIMESPEC_CLEAR(&itransfer->submit_time);
+	itransfer->num_requests = 0;
 
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
+	list_add_tail(&itransfer->list, &ctx->flying_transfers);
+	list_add_tail(&itransfer->handle_list,
+		&USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle->flying_transfers);
 
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	/* transfers with infinite timeout never enter the heap */
+	if (!TIMESPEC_IS_SET(&itransfer->timeout))
+		return 0;
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
-	}
-	/* first is 0 at this stage (list not empty) */
+	r = timeout_heap_push(ctx, itransfer);
+	if (r)
+		unlink_flying_transfer(ctx, itransfer);
+
+	return r;
+}
+
+/* add a transfer to the active transfers list, and to the timeout heap if
+ * it has a timeout.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* on the flying_transfers list. */
+static int add_to_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int r;
+
+	r = add_to_flying_list_unarmed(itransfer);
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
 #ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
+	if (!r && itransfer->timeout_heap_index == 1 && usbi_using_timer(ctx)) {
 		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		usbi_dbg("arm timer for timeout in %ums (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
+		 * make sure the timer expires in time for it */
+		r = arm_timer_for_timeout(ctx, itransfer);
+		if (r)
+			unlink_flying_transfer(ctx, itransfer);
 	}
 #else
-	UNUSED(first);
+	UNUSED(ctx);
 #endif
 
-	if (r)
-		list_del(&itransfer->list);
-
 	return r;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+/* remove a transfer from the active transfers list. the timer is not
+ * touched, if this transfer had the earliest timeout the timer expires early
+ * and is rearmed from handle_timer_trigger(). */
+static void remove_from_flying_list(struct usbi_transfer *itransfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int rearm_timer;
-	int r = 0;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
-	list_del(&itransfer->list);
-	if (rearm_timer)
-		r = arm_timer_for_next_timeout(ctx);
+	unlink_flying_transfer(ctx, itransfer);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	return r;
 }
 
 /** \ingroup libusb_asyncio
@@ -1550,7 +1766,7 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	 */
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-	r = usbi_backend.submit_transfer(itransfer);
+	r = usbi_active_backend->submit_transfer(itransfer);
 	if (r == LIBUSB_SUCCESS) {
 		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
 		/* keep a reference to this device */
@@ -1564,6 +1780,140 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	return r;
 }
 
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() for each transfer in turn, but all transfers are
+ * added to the list of active transfers under a single acquisition of the
+ * context's lock, the timer is rearmed at most once for the whole batch and
+ * the transfers are then handed to the backend back to back. Priming a deep
+ * queue of transfers this way is considerably cheaper.
+ *
+ * All transfers must belong to device handles of the same context.
+ * Submission stops at the first transfer that cannot be submitted. That
+ * transfer and the ones after it are not in flight when this function
+ * returns and may be submitted again, though their internal state may have
+ * been reset as for a submission. A transfer that appears in the array more
+ * than once cannot be submitted a second time, just like one that is already
+ * in flight.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param transfers the transfers to submit
+ * \param count the number of transfers in the array
+ * \returns the number of transfers submitted, which is less than count if
+ * the transfer at that index could not be submitted
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfers do not all belong to
+ * the same context
+ * \returns another LIBUSB_ERROR code if the first transfer could not be
+ * submitted, see libusb_submit_transfer()
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *first_timeout;
+	int i, n, r = 0;
+
+	if (count <= 0)
+		return count ? LIBUSB_ERROR_INVALID_PARAM : 0;
+
+	ctx = TRANSFER_CTX(transfers[0]);
+	for (i = 1; i < count; i++) {
+		if (TRANSFER_CTX(transfers[i]) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_dbg("%d transfers", count);
+
+	/* locking follows libusb_submit_transfer(), except that the lock of each
+	 * transfer in the batch is held until that transfer has been submitted */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	first_timeout = ctx->timeout_heap_len ? ctx->timeout_heap[0] : NULL;
+	for (n = 0; n < count; n++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[n]);
+
+		/* a transfer listed twice would deadlock on its own lock */
+		if (itransfer->timeout_flags & USBI_TRANSFER_IN_BATCH) {
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+		itransfer->transferred = 0;
+		itransfer->state_flags = 0;
+		itransfer->timeout_flags = USBI_TRANSFER_IN_BATCH;
+		r = add_to_flying_list_unarmed(itransfer);
+		if (r) {
+			itransfer->timeout_flags = 0;
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
+	}
+	for (i = 0; i < n; i++)
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])->timeout_flags &= ~USBI_TRANSFER_IN_BATCH;
+
+#ifdef HAVE_OS_TIMER
+	/* a single timer update covers every transfer of the batch */
+	if (ctx->timeout_heap_len && ctx->timeout_heap[0] != first_timeout &&
+	    usbi_using_timer(ctx)) {
+		int arm_r = arm_timer_for_timeout(ctx, ctx->timeout_heap[0]);
+
+		if (arm_r) {
+			for (i = 0; i < n; i++) {
+				struct usbi_transfer *itransfer =
+					LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+				unlink_flying_transfer(ctx, itransfer);
+				usbi_mutex_unlock(&itransfer->lock);
+			}
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			return arm_r;
+		}
+	}
+#else
+	UNUSED(first_timeout);
+#endif
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	for (i = 0; i < n; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		r = usbi_active_backend->submit_transfer(itransfer);
+		if (r != LIBUSB_SUCCESS)
+			break;
+		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		/* keep a reference to this device */
+		libusb_ref_device(transfers[i]->dev_handle->dev);
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+
+	if (i < n) {
+		int j;
+
+		for (j = i; j < n; j++)
+			usbi_mutex_unlock(&LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[j])->lock);
+
+		/* take the transfers that never reached the backend off the list */
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		for (j = i; j < n; j++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[j]);
+
+			unlink_flying_transfer(ctx, itransfer);
+		}
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	}
+
+	return i ? i : r;
+}
+
 /** \ingroup libusb_asyncio
  * Asynchronously cancel a previously submitted transfer.
  * This function returns immediately, but this does not indicate cancellation
@@ -1591,7 +1941,7 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
 	}
-	r = usbi_backend.cancel_transfer(itransfer);
+	r = usbi_active_backend->cancel_transfer(itransfer);
 	if (r < 0) {
 		if (r != LIBUSB_ERROR_NOT_FOUND &&
 		    r != LIBUSB_ERROR_NO_DEVICE)
@@ -1611,6 +1961,59 @@ out:
 	return r;
 }
 
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel all transfers of a device handle that are in flight,
+ * or only those on one endpoint. This behaves like calling
+ * libusb_cancel_transfer() for each of these transfers, but finds them
+ * without walking the transfers of other device handles and under a single
+ * acquisition of the context's lock, which makes it the cheaper way to stop a
+ * deep queue of transfers.
+ *
+ * As with libusb_cancel_transfer(), the callback of every cancelled transfer
+ * is invoked later with a status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED".
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint whose transfers to cancel, or
+ * -1 to cancel the transfers on every endpoint
+ * \returns the number of transfers whose cancellation was started, which is
+ * 0 if there were none in flight
+ * \returns LIBUSB_ERROR_INVALID_PARAM if endpoint is not a valid endpoint
+ * address or -1
+ */
+int API_EXPORTED libusb_cancel_transfers(libusb_device_handle *dev_handle,
+	int endpoint)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+	int count = 0;
+
+	if (endpoint < -1 || endpoint > 0xff)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* holding flying_transfers_lock keeps the transfers from completing
+	 * while walking the list, the same way handle_timeouts_locked() cancels
+	 * expired transfers */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for_each_handle_transfer(dev_handle, itransfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (endpoint != -1 && transfer->endpoint != endpoint)
+			continue;
+
+		if (libusb_cancel_transfer(transfer) == LIBUSB_SUCCESS)
+			count++;
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	usbi_dbg("cancelled %d transfers", count);
+	return count;
+}
+
 /** \ingroup libusb_asyncio
  * Set a transfers bulk stream id. Note users are advised to use
  * libusb_fill_bulk_stream_transfer() instead of calling this function
@@ -1648,69 +2051,796 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
 	return itransfer->stream_id;
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
-	enum libusb_transfer_status status)
+/** \ingroup libusb_asyncio
+ * Make a bulk or interrupt transfer vectored: instead of the single
+ * contiguous buffer, the data is transferred to or from the given list of
+ * segments in order, so that e.g. a protocol header and its payload can be
+ * received straight into separately owned buffers without a reassembly
+ * copy. Call this after filling the transfer. The transfer's length is set to
+ * the total length of the segments and its buffer to that of the first
+ * segment. The segment array and the buffers it points to must remain valid
+ * until the transfer completes.
+ *
+ * The segments only apply to the next submission of the transfer. libusb
+ * forgets them when the transfer completes, before calling its callback, so
+ * they must be set again every time the transfer is to be resubmitted as a
+ * vectored one. The buffer and length of the transfer still describe all
+ * segments then, so a transfer resubmitted as a plain one must be filled
+ * again first. If the submission fails, the segments are kept.
+ *
+ * Every segment but the last should be a multiple of the endpoint's maximum
+ * packet size, as the segments may be transferred as separate requests and a
+ * short packet ends the transfer.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param transfer the transfer to set the segments for
+ * \param iov the segments, or NULL to go back to the contiguous buffer
+ * \param iov_count the number of segments
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not a bulk or
+ * interrupt transfer or a segment is not valid
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support
+ * vectored transfers
+ */
+int API_EXPORTED libusb_transfer_set_bulk_iov(struct libusb_transfer *transfer,
+	const struct libusb_bulk_iovec *iov, int iov_count)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_device_handle *dev_handle = transfer->dev_handle;
-	uint8_t flags;
-	int r;
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int i, length = 0;
 
-	r = remove_from_flying_list(itransfer);
-	if (r < 0)
-		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout");
+	if (!iov) {
+		itransfer->bulk_iov = NULL;
+		itransfer->bulk_iov_count = 0;
+		return 0;
+	}
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	if (!(usbi_active_backend->caps & USBI_CAP_SUPPORTS_BULK_IOV))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
-		}
+	if (iov_count <= 0 ||
+	    (transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+	     transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM &&
+	     transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < iov_count; i++) {
+		if (iov[i].length < 0 || iov[i].length > INT_MAX - length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length += iov[i].length;
 	}
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	libusb_unref_device(dev_handle->dev);
-	return r;
+	itransfer->bulk_iov = iov;
+	itransfer->bulk_iov_count = iov_count;
+	transfer->buffer = iov[0].buffer;
+	transfer->length = length;
+	return 0;
 }
 
-/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
- * that were asynchronously cancelled. The same concerns w.r.t. freeing of
- * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
+struct libusb_stream {
+	libusb_device_handle *dev_handle;
+	libusb_stream_cb_fn callback;
+	void *user_data;
+
+	/* a single block backing all buffers, from libusb_dev_mem_alloc() when
+	 * the backend supports it and from malloc() otherwise */
+	unsigned char *buffers;
+	size_t buffers_len;
+	int dev_mem;
+	int buffer_size;
+
+	/* serializes resubmission against libusb_stream_close() */
+	usbi_mutex_t lock;
+	int num_submitted;	/* Protected by lock */
+	int closing;		/* Protected by lock */
+	int closed;		/* set once nothing is submitted after closing */
+
+	int num_transfers;
+	struct libusb_transfer *transfers[ZERO_SIZED_ARRAY];
+};
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t timed_out;
+	struct libusb_stream *stream = transfer->user_data;
+	enum libusb_transfer_status status = transfer->status;
+	int closing, keep = 0, r;
+
+	usbi_mutex_lock(&stream->lock);
+	closing = stream->closing;
+	usbi_mutex_unlock(&stream->lock);
+
+	if (!closing && status != LIBUSB_TRANSFER_CANCELLED)
+		keep = stream->callback(stream, transfer->buffer,
+			transfer->actual_length, status, stream->user_data);
+
+	usbi_mutex_lock(&stream->lock);
+	if (!keep && !stream->closing &&
+	    (status == LIBUSB_TRANSFER_COMPLETED || status == LIBUSB_TRANSFER_TIMED_OUT)) {
+		r = libusb_submit_transfer(transfer);
+		if (r == LIBUSB_SUCCESS) {
+			usbi_mutex_unlock(&stream->lock);
+			return;
+		}
+		usbi_err(HANDLE_CTX(stream->dev_handle), "failed to resubmit stream buffer, error %d", r);
+	}
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
+	if (--stream->num_submitted == 0 && stream->closing)
+		stream->closed = 1;
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/* handle the events of a stream's handle that is taken out of the context's
+ * event handling, or wait for the thread that handles them to do so */
+static int stream_wait_dedicated(struct libusb_stream *stream)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	struct timeval tv = { 0, 100000 };
+	int r;
+
+	r = libusb_handle_device_events_timeout(stream->dev_handle, &tv);
+	if (r != LIBUSB_ERROR_BUSY)
+		return r;
+
+	libusb_lock_event_waiters(ctx);
+	if (!stream->closed)
+		libusb_wait_for_event(ctx, &tv);
+	libusb_unlock_event_waiters(ctx);
+	return 0;
+}
+
+/* cancel everything still submitted on a stream and wait for it to come back.
+ * the stream lock must not be held. */
+static void stream_stop(struct libusb_stream *stream)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	int i, r;
+
+	usbi_mutex_lock(&stream->lock);
+	stream->closing = 1;
+	if (!stream->num_submitted)
+		stream->closed = 1;
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_cancel_transfer(stream->transfers[i]);
+	usbi_mutex_unlock(&stream->lock);
+
+	while (!stream->closed) {
+		if (stream->dev_handle->dedicated_events)
+			r = stream_wait_dedicated(stream);
+		else
+			r = libusb_handle_events_completed(ctx, &stream->closed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				 libusb_error_name(r));
+	}
+}
+
+static void stream_free(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_free_transfer(stream->transfers[i]);
+
+	if (stream->dev_mem)
+		libusb_dev_mem_free(stream->dev_handle, stream->buffers, stream->buffers_len);
+	else
+		free(stream->buffers);
+
+	usbi_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/** \ingroup libusb_asyncio
+ * Open a persistent stream on a bulk IN endpoint. libusb allocates
+ * num_buffers buffers of buffer_size bytes each, submits a transfer for every
+ * one of them and keeps them submitted from within the event handler: each
+ * time a buffer is filled it is passed to the callback and, once the
+ * application is done with it, resubmitted without a round trip through
+ * libusb_submit_transfer() in application code. This keeps the device's
+ * endpoint queue full, which is what sustains line rate on a busy bulk
+ * endpoint.
+ *
+ * The buffers are allocated with libusb_dev_mem_alloc() where the backend
+ * supports it, and from regular memory otherwise.
+ *
+ * The callback is called from the thread handling events for the context. It
+ * may return 1 to keep the buffer, in which case it is not resubmitted until
+ * the application hands it back with libusb_stream_release_buffer(). A buffer
+ * that completes with a status other than \ref LIBUSB_TRANSFER_COMPLETED or
+ * \ref LIBUSB_TRANSFER_TIMED_OUT is not resubmitted; the application will
+ * usually close the stream at that point.
+ *
+ * Note that these streams are unrelated to USB 3.0 bulk streams, see
+ * libusb_alloc_streams() for those.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of a bulk IN endpoint
+ * \param num_buffers the number of buffers to keep submitted
+ * \param buffer_size the size of each buffer
+ * \param timeout timeout for each transfer, in milliseconds. A buffer that
+ * times out is passed to the callback with the data received so far.
+ * \param callback the function called for each filled buffer
+ * \param user_data user data passed to the callback
+ * \param stream output location for the stream. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the parameters are not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if submitting a transfer fails
+ * \see libusb_stream_close()
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_buffers, int buffer_size,
+	unsigned int timeout, libusb_stream_cb_fn callback, void *user_data,
+	libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	int i, r;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) || num_buffers <= 0 ||
+	    buffer_size <= 0 || !callback || !stream)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_stream = calloc(1, sizeof(*_stream) + (size_t)num_buffers * sizeof(_stream->transfers[0]));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_stream->dev_handle = dev_handle;
+	_stream->callback = callback;
+	_stream->user_data = user_data;
+	_stream->buffer_size = buffer_size;
+	_stream->buffers_len = (size_t)num_buffers * (size_t)buffer_size;
+	usbi_mutex_init(&_stream->lock);
+
+	_stream->buffers = libusb_dev_mem_alloc(dev_handle, _stream->buffers_len);
+	if (_stream->buffers) {
+		_stream->dev_mem = 1;
+	} else {
+		_stream->buffers = malloc(_stream->buffers_len);
+		if (!_stream->buffers) {
+			stream_free(_stream);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < num_buffers; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+		if (!transfer) {
+			stream_free(_stream);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+
+		libusb_fill_bulk_transfer(transfer, dev_handle, endpoint,
+			_stream->buffers + (size_t)i * (size_t)buffer_size, buffer_size,
+			stream_transfer_cb, _stream, timeout);
+		_stream->transfers[_stream->num_transfers++] = transfer;
+	}
+
+	usbi_mutex_lock(&_stream->lock);
+	for (i = 0; i < num_buffers; i += r) {
+		r = libusb_submit_transfers(_stream->transfers + i, num_buffers - i);
+		if (r < 0) {
+			usbi_mutex_unlock(&_stream->lock);
+			stream_stop(_stream);
+			stream_free(_stream);
+			return r;
+		}
+		_stream->num_submitted += r;
+	}
+	usbi_mutex_unlock(&_stream->lock);
+
+	usbi_dbg("opened stream on endpoint 0x%02x with %d buffers of %d bytes%s",
+		 endpoint, num_buffers, buffer_size, _stream->dev_mem ? " (device memory)" : "");
+	*stream = _stream;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Hand a buffer that the stream callback kept back to the stream, which
+ * resubmits it.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param stream the stream the buffer belongs to
+ * \param buffer a buffer passed to the stream callback that returned 1
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the buffer does not belong to the stream
+ * \returns LIBUSB_ERROR_NOT_FOUND if the stream is being closed
+ * \returns another LIBUSB_ERROR code if submitting the transfer fails
+ */
+int API_EXPORTED libusb_stream_release_buffer(libusb_stream *stream,
+	unsigned char *buffer)
+{
+	size_t offset;
+	int r;
+
+	if (buffer < stream->buffers)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	offset = (size_t)(buffer - stream->buffers);
+	if (offset >= stream->buffers_len || offset % (size_t)stream->buffer_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->closing) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	} else {
+		r = libusb_submit_transfer(stream->transfers[offset / (size_t)stream->buffer_size]);
+		if (r == LIBUSB_SUCCESS)
+			stream->num_submitted++;
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Close a stream opened with libusb_stream_open(). Any buffers still
+ * submitted are cancelled, and this function handles events until all of
+ * them have come back, after which the stream and its buffers are freed. The
+ * callback is not called for buffers that complete while the stream is
+ * closing.
+ *
+ * This function must not be called from within an event handling callback,
+ * including the stream callback itself.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param stream the stream to close
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if called from event handling context
+ */
+int API_EXPORTED libusb_stream_close(libusb_stream *stream)
+{
+	if (usbi_handling_events(HANDLE_CTX(stream->dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	stream_stop(stream);
+	stream_free(stream);
+	return 0;
+}
+
+struct libusb_buffer_pool {
+	/* must stay open until the pool is destroyed */
+	libusb_device_handle *dev_handle;
+
+	/* a single block backing all buffers, see libusb_buffer_pool_create() */
+	unsigned char *buffers;
+	size_t buffers_len;
+	enum {
+		POOL_MEM_MALLOC,
+		POOL_MEM_DEVICE,
+		POOL_MEM_MAPPED
+	} mem;
+	int buffer_size;
+	int num_buffers;
+
+	/* the indices of the free buffers are kept on a stack, so that handing
+	 * out and returning a buffer are both O(1) */
+	usbi_mutex_t lock;
+	unsigned char *in_use;	/* Protected by lock */
+	int num_free;		/* Protected by lock */
+	int free_buffers[ZERO_SIZED_ARRAY];	/* Protected by lock */
+};
+
+#if defined(PLATFORM_POSIX)
+#define POOL_HUGE_PAGE_SIZE	(2UL * 1024 * 1024)
+
+/* map memory for the buffers of a pool. huge pages are preferred, either
+ * reserved ones or transparent ones where the system has them enabled, to cut
+ * the TLB misses of large buffers. the memory is locked so that buffers never
+ * fault while in use, or at least faulted in when locking is not permitted.
+ * either way the creating thread touches every page first, so under the
+ * default first-touch policy the pages are placed on its NUMA node.
+ * updates len to the length actually mapped, returns NULL on failure. */
+static void *pool_map(size_t *len)
+{
+	void *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (*len >= POOL_HUGE_PAGE_SIZE) {
+		size_t huge_len = (*len + POOL_HUGE_PAGE_SIZE - 1) & ~(POOL_HUGE_PAGE_SIZE - 1);
+
+		mem = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			*len = huge_len;
+	}
+#endif
+
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			usbi_dbg("mmap failed, errno=%d", errno);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(mem, *len, MADV_HUGEPAGE);
+#endif
+	}
+
+	if (mlock(mem, *len) == -1) {
+		usbi_dbg("mlock failed, errno=%d", errno);
+		memset(mem, 0, *len);
+	}
+
+	return mem;
+}
+#endif
+
+static void pool_free(struct libusb_buffer_pool *pool)
+{
+	switch (pool->mem) {
+	case POOL_MEM_DEVICE:
+		libusb_dev_mem_free(pool->dev_handle, pool->buffers, pool->buffers_len);
+		break;
+#if defined(PLATFORM_POSIX)
+	case POOL_MEM_MAPPED:
+		munmap(pool->buffers, pool->buffers_len);
+		break;
+#endif
+	default:
+		free(pool->buffers);
+		break;
+	}
+
+	free(pool->in_use);
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/** \ingroup libusb_asyncio
+ * Create a pool of transfer buffers. All num_buffers buffers of buffer_size
+ * bytes are allocated up front from a single block of memory, and are then
+ * taken from the pool with libusb_buffer_pool_get() and returned to it with
+ * libusb_buffer_pool_put() at constant cost. Recycling buffers this way
+ * rather than allocating one for every transfer avoids the page faults and
+ * TLB misses of freshly allocated memory in long running applications.
+ *
+ * The memory is allocated with libusb_dev_mem_alloc() when a device handle is
+ * given and the backend supports it. Otherwise, on POSIX platforms it is
+ * mapped backed by huge pages where available, locked into RAM where the
+ * memory lock limit permits and placed on the NUMA node of the calling
+ * thread. Elsewhere it comes from regular memory.
+ *
+ * A pool created for a device handle is tied to it and must be destroyed
+ * with libusb_buffer_pool_destroy() before the handle is closed.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle the device handle the buffers are used with, or NULL
+ * \param num_buffers the number of buffers in the pool
+ * \param buffer_size the size of each buffer
+ * \param pool output location for the pool. Only populated if the return
+ * code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the parameters are not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_buffer_pool_destroy()
+ */
+int API_EXPORTED libusb_buffer_pool_create(libusb_device_handle *dev_handle,
+	int num_buffers, int buffer_size, libusb_buffer_pool **pool)
+{
+	struct libusb_buffer_pool *_pool;
+	int i;
+
+	if (num_buffers <= 0 || buffer_size <= 0 || !pool ||
+	    (size_t)num_buffers > SIZE_MAX / (size_t)buffer_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_pool = calloc(1, sizeof(*_pool) + (size_t)num_buffers * sizeof(_pool->free_buffers[0]));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->dev_handle = dev_handle;
+	_pool->buffer_size = buffer_size;
+	_pool->num_buffers = num_buffers;
+	_pool->buffers_len = (size_t)num_buffers * (size_t)buffer_size;
+	usbi_mutex_init(&_pool->lock);
+
+	if (dev_handle) {
+		_pool->buffers = libusb_dev_mem_alloc(dev_handle, _pool->buffers_len);
+		if (_pool->buffers)
+			_pool->mem = POOL_MEM_DEVICE;
+	}
+#if defined(PLATFORM_POSIX)
+	if (!_pool->buffers) {
+		_pool->buffers = pool_map(&_pool->buffers_len);
+		if (_pool->buffers)
+			_pool->mem = POOL_MEM_MAPPED;
+	}
+#endif
+	if (!_pool->buffers)
+		_pool->buffers = malloc(_pool->buffers_len);
+
+	_pool->in_use = calloc((size_t)num_buffers, 1);
+	if (!_pool->buffers || !_pool->in_use) {
+		pool_free(_pool);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* hand out the buffers in address order */
+	for (i = 0; i < num_buffers; i++)
+		_pool->free_buffers[i] = num_buffers - 1 - i;
+	_pool->num_free = num_buffers;
+
+	usbi_dbg("created pool of %d buffers of %d bytes%s", num_buffers, buffer_size,
+		 _pool->mem == POOL_MEM_DEVICE ? " (device memory)" :
+		 _pool->mem == POOL_MEM_MAPPED ? " (mapped memory)" : "");
+	*pool = _pool;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a pool of transfer buffers and free its memory. Every buffer of the
+ * pool must be out of use, in particular no transfer using one may still be
+ * in flight, but buffers need not have been returned to the pool.
+ *
+ * If the pool was created for a device handle, it must be destroyed before
+ * libusb_close() is called on that handle, as its memory may belong to the
+ * device.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param pool the pool to destroy. If NULL, this function does nothing.
+ */
+void API_EXPORTED libusb_buffer_pool_destroy(libusb_buffer_pool *pool)
+{
+	if (pool)
+		pool_free(pool);
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool. The buffer is
+ * \ref libusb_buffer_pool_create() "buffer_size" bytes long and remains the
+ * caller's until it is handed back with libusb_buffer_pool_put().
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param pool the pool to take a buffer from
+ * \returns a buffer, or NULL if every buffer of the pool is in use
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_buffer_pool_get(libusb_buffer_pool *pool)
+{
+	unsigned char *buffer = NULL;
+	int i;
+
+	usbi_mutex_lock(&pool->lock);
+	if (pool->num_free) {
+		i = pool->free_buffers[--pool->num_free];
+		pool->in_use[i] = 1;
+		buffer = pool->buffers + (size_t)i * (size_t)pool->buffer_size;
+	}
+	usbi_mutex_unlock(&pool->lock);
+
+	return buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Return a buffer taken with libusb_buffer_pool_get() to its pool.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param pool the pool the buffer was taken from
+ * \param buffer the buffer to return
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the buffer does not belong to the
+ * pool or has already been returned
+ */
+int API_EXPORTED libusb_buffer_pool_put(libusb_buffer_pool *pool,
+	unsigned char *buffer)
+{
+	size_t offset;
+	int i, r = 0;
+
+	if (buffer < pool->buffers)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	offset = (size_t)(buffer - pool->buffers);
+	if (offset % (size_t)pool->buffer_size ||
+	    offset / (size_t)pool->buffer_size >= (size_t)pool->num_buffers)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	i = (int)(offset / (size_t)pool->buffer_size);
+
+	usbi_mutex_lock(&pool->lock);
+	if (pool->in_use[i]) {
+		pool->in_use[i] = 0;
+		pool->free_buffers[pool->num_free++] = i;
+	} else {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+	}
+	usbi_mutex_unlock(&pool->lock);
+
+	return r;
+}
+
+/* Account a finished transfer in the statistics of its endpoint. */
+static void update_endpoint_stats(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+	struct timespec now, latency;
+	uint64_t latency_us;
+	unsigned int bucket;
+	int rqlen = transfer->length;
+
+	if (!TIMESPEC_IS_SET(&itransfer->submit_time))
+		return;
+
+	usbi_get_monotonic_time(&now);
+	TIMESPEC_SUB(&now, &itransfer->submit_time, &latency);
+	TIMESPEC_CLEAR(&itransfer->submit_time);
+	latency_us = (uint64_t)latency.tv_sec * 1000000 + (uint64_t)latency.tv_nsec / 1000;
+	for (bucket = 0; bucket < LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS - 1; bucket++) {
+		if (latency_us < (UINT64_C(2) << bucket))
+			break;
+	}
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!dev_handle->ep_stats) {
+		dev_handle->ep_stats = calloc(USB_MAXENDPOINTS, sizeof(*dev_handle->ep_stats));
+		if (!dev_handle->ep_stats) {
+			usbi_mutex_unlock(&dev_handle->lock);
+			return;
+		}
+	}
+
+	stats = &dev_handle->ep_stats[USBI_EP_STATS_INDEX(transfer->endpoint)];
+	stats->transfers++;
+	stats->bytes += (uint64_t)itransfer->transferred;
+	stats->requests += itransfer->num_requests ? itransfer->num_requests : 1;
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (itransfer->transferred < rqlen)
+			stats->short_transfers++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timeouts++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancellations++;
+		break;
+	default:
+		stats->errors++;
+	}
+	stats->latency_total_us += latency_us;
+	if (latency_us > stats->latency_max_us)
+		stats->latency_max_us = latency_us;
+	stats->latency_histogram[bucket]++;
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Get the transfer statistics of one endpoint of a device handle. Statistics
+ * are only collected while \ref LIBUSB_OPTION_ENDPOINT_STATS is enabled on the
+ * handle's context; all counters read zero until then. Comparing the latency
+ * histogram of an endpoint with the time spent in the application helps to
+ * tell whether a slowdown comes from the device, the operating system or the
+ * application.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats)
+{
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->ep_stats)
+		*stats = dev_handle->ep_stats[USBI_EP_STATS_INDEX(endpoint)];
+	else
+		memset(stats, 0, sizeof(*stats));
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Reset the transfer statistics of one endpoint of a device handle to zero.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_reset_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->ep_stats)
+		memset(&dev_handle->ep_stats[USBI_EP_STATS_INDEX(endpoint)], 0,
+		       sizeof(*dev_handle->ep_stats));
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	return 0;
+}
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
+ * after calling this function, and you should free all backend-specific
+ * data before calling it.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	uint8_t flags;
+
+	remove_from_flying_list(itransfer);
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	/* segments set with libusb_transfer_set_bulk_iov() only apply to the
+	 * submission that just ended */
+	itransfer->bulk_iov = NULL;
+	itransfer->bulk_iov_count = 0;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	update_endpoint_stats(itransfer, status);
+
+	flags = transfer->flags;
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	libusb_unref_device(dev_handle->dev);
+	return 0;
+}
+
+/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
+ * that were asynchronously cancelled. The same concerns w.r.t. freeing of
+ * transfers exist here.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	uint8_t timed_out;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	/* if the URB was cancelled due to timeout, report timeout to the user */
@@ -1723,8 +2853,8 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
+/* Add a completed transfer to the completed queue of the context and, if the
+ * queue was empty, signal the event. The backend's handle_transfer_completion()
  * function will be called the next time an event handler runs. */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
@@ -1732,18 +2862,40 @@ void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 
 	if (dev_handle) {
 		struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+		void *head = usbi_atomic_ptr_load(&ctx->completed_queue);
 		unsigned int event_flags;
 
+		do {
+			itransfer->completed_next = head;
+		} while (!usbi_atomic_ptr_compare_exchange(&ctx->completed_queue, &head, itransfer));
+
+		/* transfers pushed behind this one are picked up by the same event */
+		if (head)
+			return;
+
 		usbi_mutex_lock(&ctx->event_data_lock);
 		event_flags = ctx->event_flags;
 		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
 		if (!event_flags)
 			usbi_signal_event(&ctx->event);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 	}
 }
 
+/* Move everything on the completed queue to the tail of the completed_transfers
+ * list, restoring completion order. Callers must hold the event_data_lock. */
+static void take_completed_transfers(struct libusb_context *ctx)
+{
+	struct list_head *tail = ctx->completed_transfers.prev;
+	struct usbi_transfer *itransfer;
+
+	itransfer = usbi_atomic_ptr_exchange(&ctx->completed_queue, NULL);
+	while (itransfer) {
+		list_add(&itransfer->completed_list, tail);
+		itransfer = itransfer->completed_next;
+	}
+}
+
 /** \ingroup libusb_poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusb event sources at any one time.
@@ -2034,30 +3186,21 @@ static void handle_timeouts_locked(struct libusb_context *ctx)
 	struct timespec systime;
 	struct usbi_transfer *itransfer;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return;
 
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
-
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
+	/* pop expired timeouts off the heap until the earliest remaining one
+	 * lies in the future */
+	while ((itransfer = next_timeout_transfer(ctx))) {
 		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
+		if (TIMESPEC_CMP(&itransfer->timeout, &systime, >))
 			return;
 
 		/* otherwise, we've got an expired timeout to handle */
+		usbi_remove_transfer_timeout(ctx, itransfer);
 		handle_timeout(itransfer);
 	}
 }
@@ -2108,13 +3251,16 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		struct usbi_transfer *itransfer, *tmp;
 		struct list_head completed_transfers;
 
-		assert(!list_empty(&ctx->completed_transfers));
+		/* clear the flag before emptying the queue so that a transfer
+		 * pushed from now on raises it again */
+		ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+		take_completed_transfers(ctx);
 		list_cut(&completed_transfers, &ctx->completed_transfers);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 
 		__for_each_completed_transfer_safe(&completed_transfers, itransfer, tmp) {
 			list_del(&itransfer->completed_list);
-			r = usbi_backend.handle_transfer_completion(itransfer);
+			r = usbi_active_backend->handle_transfer_completion(itransfer);
 			if (r) {
 				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
 				break;
@@ -2125,8 +3271,7 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		if (!list_empty(&completed_transfers)) {
 			/* an error occurred, put the remaining transfers back on the list */
 			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+			ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
 		}
 	}
 
@@ -2251,7 +3396,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (!reported_events.num_ready)
 		goto done;
 
-	r = usbi_backend.handle_events(ctx, reported_events.event_data,
+	r = usbi_active_backend->handle_events(ctx, reported_events.event_data,
 		reported_events.event_data_count, reported_events.num_ready);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
@@ -2478,6 +3623,165 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 	return handle_events(ctx, &poll_timeout);
 }
 
+/** \ingroup libusb_poll
+ * Take the events of a device handle out of the context's event handling
+ * (or put them back). While enabled, completions of transfers on this handle
+ * are no longer processed by libusb_handle_events() and friends, but only by
+ * libusb_handle_device_events_timeout() for this handle. This lets an
+ * application dedicate one thread to each of several busy devices so that
+ * their completions are processed in parallel instead of one after the other
+ * by the single thread holding the event handling lock.
+ *
+ * Enable this before submitting transfers on the handle, and only disable it
+ * again once none are pending, otherwise their completions may be processed
+ * by either kind of event handler. The handle must not be closed, and no
+ * stream of it closed, while another thread handles its events.
+ * Synchronous I/O on the handle handles its events itself, or waits for the
+ * thread that does to complete the transfer.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param enable non-zero to handle the events of the handle separately, zero
+ * to return them to the context's event handling
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if another thread is handling the events of the
+ * handle
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support it
+ * \returns another LIBUSB_ERROR code on other failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_set_dedicated_event_handling(
+	libusb_device_handle *dev_handle, int enable)
+{
+	int r = LIBUSB_SUCCESS;
+
+	if (!usbi_active_backend->set_dedicated_events)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (!usbi_mutex_trylock(&dev_handle->events_lock))
+		return LIBUSB_ERROR_BUSY;
+
+	enable = !!enable;
+	if (dev_handle->dedicated_events != enable) {
+		usbi_dbg("%s dedicated event handling",
+			 enable ? "enabling" : "disabling");
+		r = usbi_active_backend->set_dedicated_events(dev_handle, enable);
+		if (r == LIBUSB_SUCCESS)
+			dev_handle->dedicated_events = enable;
+	}
+	usbi_mutex_unlock(&dev_handle->events_lock);
+
+	return r;
+}
+
+/* milliseconds until whichever comes first of tv and the next transfer
+ * timeout of the context. unlike libusb_get_next_timeout(), this also looks
+ * at the timeouts when they are tracked by the OS timer, since the context's
+ * event handler may not be running to notice it firing */
+static int next_device_events_timeout(struct libusb_context *ctx,
+	struct timeval *tv)
+{
+	struct usbi_transfer *itransfer;
+	struct timespec systime;
+	struct timespec next_timeout = { 0, 0 };
+	struct timeval timeout = *tv;
+	int timeout_ms;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	itransfer = next_timeout_transfer(ctx);
+	if (itransfer)
+		next_timeout = itransfer->timeout;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	if (TIMESPEC_IS_SET(&next_timeout)) {
+		struct timeval next_tv;
+
+		usbi_get_monotonic_time(&systime);
+		if (!TIMESPEC_CMP(&systime, &next_timeout, <))
+			return 0;
+
+		TIMESPEC_SUB(&next_timeout, &systime, &next_timeout);
+		TIMESPEC_TO_TIMEVAL(&next_tv, &next_timeout);
+		if (timercmp(&next_tv, &timeout, <))
+			timeout = next_tv;
+	}
+
+	if (timeout.tv_sec >= INT_MAX / 1000)
+		return INT_MAX;
+
+	timeout_ms = (int)(timeout.tv_sec * 1000) + (timeout.tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (timeout.tv_usec % 1000)
+		timeout_ms++;
+
+	return timeout_ms;
+}
+
+/** \ingroup libusb_poll
+ * Handle any pending events of a device handle whose events have been taken
+ * out of the context's event handling with
+ * libusb_set_dedicated_event_handling(). Transfer callbacks for the handle
+ * are called from within this function.
+ *
+ * This function does not take the context's event handling lock, so any
+ * number of threads can call it at once for different handles, alongside a
+ * thread running libusb_handle_events() for the rest of the context. Expired
+ * transfer timeouts are handled as well, including those of other handles,
+ * so that they fire even if no thread handles the events of the context.
+ *
+ * Only one thread at a time can handle the events of a given handle.
+ * Threads waiting for transfers of the handle to complete elsewhere are
+ * woken up like by libusb_unlock_events(), see libusb_wait_for_event().
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev_handle a device handle
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if timeval is invalid or the events of
+ * the handle are handled by the context
+ * \returns LIBUSB_ERROR_BUSY if another thread is handling the events of the
+ * handle, or this function was called from one of its transfer callbacks
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_handle_device_events_timeout(
+	libusb_device_handle *dev_handle, struct timeval *tv)
+{
+	struct libusb_context *ctx;
+	int timeout_ms, r;
+
+	if (!TIMEVAL_IS_VALID(tv))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = HANDLE_CTX(dev_handle);
+	if (!usbi_mutex_trylock(&dev_handle->events_lock))
+		return LIBUSB_ERROR_BUSY;
+
+	if (!dev_handle->dedicated_events) {
+		usbi_mutex_unlock(&dev_handle->events_lock);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	timeout_ms = next_device_events_timeout(ctx, tv);
+	r = usbi_active_backend->handle_device_events(dev_handle, timeout_ms);
+	if (r == LIBUSB_SUCCESS)
+		handle_timeouts(ctx);
+	usbi_mutex_unlock(&dev_handle->events_lock);
+
+	/* wake up threads waiting for one of the completions */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	return r;
+}
+
 /** \ingroup libusb_poll
  * Determines whether your application must apply special timing considerations
  * when monitoring libusb's file descriptors.
@@ -2559,17 +3863,9 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 
 	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
+	itransfer = next_timeout_transfer(ctx);
+	if (itransfer)
 		next_timeout = itransfer->timeout;
-		break;
-	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	if (!TIMESPEC_IS_SET(&next_timeout)) {
@@ -2652,6 +3948,7 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events)
 {
 	struct usbi_event_source *ievent_source = malloc(sizeof(*ievent_source));
+	int r;
 
 	if (!ievent_source)
 		return LIBUSB_ERROR_NO_MEM;
@@ -2660,6 +3957,12 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
 	usbi_mutex_lock(&ctx->event_data_lock);
+	r = usbi_register_event_source(ctx, ievent_source);
+	if (r < 0) {
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		free(ievent_source);
+		return r;
+	}
 	list_add_tail(&ievent_source->list, &ctx->event_sources);
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
@@ -2693,6 +3996,7 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 		return;
 	}
 
+	usbi_unregister_event_source(ctx, ievent_source);
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
 	usbi_event_source_notification(ctx);
@@ -2803,19 +4107,24 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 	 *    flying_transfers_lock to remove it, so we ignore it
 	 */
 
+	/* only the transfers of this handle are looked at, and the first one
+	 * is in flight unless a submission is failing concurrently, so each
+	 * pass through the list is short. the list is looked up again after
+	 * every completion as the callback may have submitted, cancelled or
+	 * freed other transfers, or closed the handle. */
 	while (1) {
 		to_cancel = NULL;
 		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		for_each_transfer(ctx, cur) {
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
-
-				if (to_cancel)
-					break;
+		for_each_handle_transfer(dev_handle, cur) {
+			usbi_mutex_lock(&cur->lock);
+			if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+				usbi_active_backend->clear_transfer_priv(cur);
+				to_cancel = cur;
 			}
+			usbi_mutex_unlock(&cur->lock);
+
+			if (to_cancel)
+				break;
 		}
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
@@ -2825,9 +4134,6 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 		usbi_dbg("cancelling transfer %p from disconnect",
 			 USBI_TRANSFER_TO_LIBUSB_TRANSFER(to_cancel));
 
-		usbi_mutex_lock(&to_cancel->lock);
-		usbi_backend.clear_transfer_priv(to_cancel);
-		usbi_mutex_unlock(&to_cancel->lock);
 		usbi_handle_transfer_completion(to_cancel, LIBUSB_TRANSFER_NO_DEVICE);
 	}
 }
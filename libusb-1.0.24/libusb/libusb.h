@@ -136,7 +136,7 @@ typedef SSIZE_T ssize_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x01000108
+#define LIBUSB_API_VERSION 0x01000109
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -1014,6 +1014,20 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup libusb_dev
+ * A vendor and product ID pair to look for with
+ * libusb_open_device_with_ids().
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ */
+struct libusb_device_id {
+	/** USB-IF vendor ID */
+	uint16_t idVendor;
+
+	/** USB-IF product ID */
+	uint16_t idProduct;
+};
+
 /** \ingroup libusb_dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1280,6 +1294,51 @@ struct libusb_transfer {
 	struct libusb_iso_packet_descriptor iso_packet_desc[ZERO_SIZED_ARRAY];
 };
 
+/** \ingroup libusb_asyncio
+ * One segment of a vectored bulk transfer, see libusb_transfer_set_bulk_iov().
+ */
+struct libusb_bulk_iovec {
+	/** Data buffer for this segment */
+	unsigned char *buffer;
+
+	/** Length of the data buffer. Must be non-negative. */
+	int length;
+};
+
+/** \ingroup libusb_asyncio
+ * Structure representing a persistent bulk IN stream opened with
+ * libusb_stream_open(). This is an opaque type for which you are only ever
+ * provided with a pointer.
+ */
+typedef struct libusb_stream libusb_stream;
+
+/** \ingroup libusb_asyncio
+ * Stream callback function type. libusb calls this function from within the
+ * event handler each time one of the buffers of a stream opened with
+ * libusb_stream_open() completes.
+ *
+ * \param stream the stream the buffer belongs to
+ * \param buffer the buffer that was filled
+ * \param length the number of bytes received into the buffer
+ * \param status the status of the underlying transfer. The buffer is only
+ * resubmitted for \ref LIBUSB_TRANSFER_COMPLETED and
+ * \ref LIBUSB_TRANSFER_TIMED_OUT.
+ * \param user_data the user_data passed to libusb_stream_open()
+ * \returns 0 to have the buffer resubmitted as soon as the callback returns
+ * \returns 1 to keep the buffer until it is handed back with
+ * libusb_stream_release_buffer()
+ */
+typedef int (LIBUSB_CALL *libusb_stream_cb_fn)(libusb_stream *stream,
+	unsigned char *buffer, int length, enum libusb_transfer_status status,
+	void *user_data);
+
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of preallocated transfer buffers created
+ * with libusb_buffer_pool_create(). This is an opaque type for which you are
+ * only ever provided with a pointer.
+ */
+typedef struct libusb_buffer_pool libusb_buffer_pool;
+
 /** \ingroup libusb_misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1429,6 +1488,8 @@ int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle,
 
 libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
 	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id);
+libusb_device_handle * LIBUSB_CALL libusb_open_device_with_ids(
+	libusb_context *ctx, const struct libusb_device_id *ids, int num_ids);
 
 int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
 	int interface_number, int alternate_setting);
@@ -1530,12 +1591,84 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_transfers(libusb_device_handle *dev_handle,
+	int endpoint);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_transfer_set_bulk_iov(struct libusb_transfer *transfer,
+	const struct libusb_bulk_iovec *iov, int iov_count);
+
+/** \ingroup libusb_asyncio
+ * Number of buckets in \ref libusb_endpoint_stats::latency_histogram
+ * "latency_histogram".
+ */
+#define LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS	24
+
+/** \ingroup libusb_asyncio
+ * Transfer statistics for one endpoint of a device handle, collected while
+ * \ref LIBUSB_OPTION_ENDPOINT_STATS is enabled. See libusb_get_endpoint_stats().
+ */
+struct libusb_endpoint_stats {
+	/** Number of transfers that completed, whatever their status */
+	uint64_t transfers;
+
+	/** Number of bytes transferred, excluding control setup packets */
+	uint64_t bytes;
+
+	/** Number of transfers that completed with less data than requested */
+	uint64_t short_transfers;
+
+	/** Number of transfers that timed out */
+	uint64_t timeouts;
+
+	/** Number of transfers that were cancelled */
+	uint64_t cancellations;
+
+	/** Number of transfers that failed for any other reason */
+	uint64_t errors;
+
+	/** Number of requests the operating system backend split the
+	 * transfers into, e.g. URBs on Linux */
+	uint64_t requests;
+
+	/** Sum of the submit-to-completion latencies, in microseconds */
+	uint64_t latency_total_us;
+
+	/** Longest submit-to-completion latency, in microseconds */
+	uint64_t latency_max_us;
+
+	/** Histogram of submit-to-completion latencies. Bucket i counts the
+	 * transfers that took less than 2^(i+1) microseconds and, except for
+	 * the first bucket, at least 2^i microseconds. The last bucket also
+	 * counts all longer transfers. */
+	uint64_t latency_histogram[LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats);
+int LIBUSB_CALL libusb_reset_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint);
+
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_buffers, int buffer_size,
+	unsigned int timeout, libusb_stream_cb_fn callback, void *user_data,
+	libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_release_buffer(libusb_stream *stream,
+	unsigned char *buffer);
+int LIBUSB_CALL libusb_stream_close(libusb_stream *stream);
+
+int LIBUSB_CALL libusb_buffer_pool_create(libusb_device_handle *dev_handle,
+	int num_buffers, int buffer_size, libusb_buffer_pool **pool);
+void LIBUSB_CALL libusb_buffer_pool_destroy(libusb_buffer_pool *pool);
+unsigned char * LIBUSB_CALL libusb_buffer_pool_get(libusb_buffer_pool *pool);
+int LIBUSB_CALL libusb_buffer_pool_put(libusb_buffer_pool *pool,
+	unsigned char *buffer);
 
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1869,6 +2002,10 @@ int LIBUSB_CALL libusb_handle_events(libusb_context *ctx);
 int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed);
 int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_set_dedicated_event_handling(
+	libusb_device_handle *dev_handle, int enable);
+int LIBUSB_CALL libusb_handle_device_events_timeout(
+	libusb_device_handle *dev_handle, struct timeval *tv);
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
@@ -2101,11 +2238,92 @@ enum libusb_option {
 	 *
 	 * Only valid on Linux-based operating system, such as Android.
 	 */
-	LIBUSB_OPTION_WEAK_AUTHORITY = 2
+	LIBUSB_OPTION_WEAK_AUTHORITY = 2,
+
+	/** Enable or disable per-endpoint transfer statistics for a context.
+	 *
+	 * Takes an int argument, non-zero to enable. While enabled, libusb
+	 * records the outcome and submit-to-completion latency of every
+	 * transfer on the context's device handles, which can be read with
+	 * libusb_get_endpoint_stats(). Disabling keeps the statistics
+	 * collected so far.
+	 *
+	 * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+	 */
+	LIBUSB_OPTION_ENDPOINT_STATS = 3,
+
+	/** Busy-poll for events before sleeping while handling events.
+	 *
+	 * Takes an int argument, the number of microseconds to spin checking
+	 * for events before blocking, or 0 (the default) to always block right
+	 * away. Events that arrive within the window are handled without the
+	 * latency of waking up the event handling thread, at the cost of
+	 * keeping a CPU busy while waiting.
+	 *
+	 * Only valid on POSIX platforms.
+	 *
+	 * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+	 */
+	LIBUSB_OPTION_BUSY_POLL = 4
 };
 
 int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
 
+/** \ingroup libusb_loopback
+ * An endpoint of a virtual device of the loopback backend.
+ * \see libusb_loopback_add_device()
+ */
+struct libusb_loopback_endpoint {
+	/** The address of the endpoint. Bits 0:3 are the endpoint number,
+	 * which must not be 0, and bit 7 the direction, see
+	 * \ref libusb_endpoint_direction. */
+	uint8_t bEndpointAddress;
+
+	/** Attributes of the endpoint as found in its endpoint descriptor.
+	 * Bits 0:1 determine the transfer type, which must not be control, see
+	 * \ref libusb_endpoint_transfer_type. */
+	uint8_t bmAttributes;
+
+	/** Maximum packet size this endpoint is capable of sending/receiving. */
+	uint16_t wMaxPacketSize;
+
+	/** Rate in bytes per second at which the endpoint produces (IN) or
+	 * consumes (OUT) data, or 0 for no limit. */
+	unsigned int bandwidth;
+
+	/** Time in microseconds each transfer takes to complete on top of
+	 * the time needed to move its data. */
+	unsigned int latency_us;
+};
+
+/** \ingroup libusb_loopback
+ * Description of a virtual device of the loopback backend.
+ * \see libusb_loopback_add_device()
+ */
+struct libusb_loopback_device {
+	/** USB-IF vendor ID */
+	uint16_t idVendor;
+
+	/** USB-IF product ID */
+	uint16_t idProduct;
+
+	/** Time in microseconds control transfers take to complete. */
+	unsigned int control_latency_us;
+
+	/** Number of endpoints besides the default control endpoint, at
+	 * most 30. */
+	int num_endpoints;
+
+	/** Array of endpoints, with num_endpoints entries. */
+	const struct libusb_loopback_endpoint *endpoints;
+};
+
+int LIBUSB_CALL libusb_loopback_add_device(libusb_context *ctx,
+	const struct libusb_loopback_device *desc, libusb_device **dev);
+int LIBUSB_CALL libusb_loopback_inject_error(libusb_device *dev,
+	unsigned char endpoint, enum libusb_transfer_status status, int count);
+int LIBUSB_CALL libusb_loopback_disconnect(libusb_device *dev);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -72,6 +72,12 @@
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 #endif
 
+#if defined(__GNUC__)
+#define UNLIKELY(cond)	__builtin_expect(!!(cond), 0)
+#else
+#define UNLIKELY(cond)	(cond)
+#endif
+
 /* The following is used to silence warnings for unused variables */
 #if defined(UNREFERENCED_PARAMETER)
 #define UNUSED(var)	UNREFERENCED_PARAMETER(var)
@@ -112,6 +118,7 @@ extern "C" {
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_SUPPORTS_BULK_IOV		0x00040000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -284,7 +291,23 @@ int usbi_vsnprintf(char *dst, size_t size, const char *format, va_list args);
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...) PRINTF_FORMAT(4, 5);
 
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __func__, __VA_ARGS__)
+/* Messages above this level are compiled out entirely. Define it to one of
+ * the LIBUSB_LOG_LEVEL_* values when building, e.g. to LIBUSB_LOG_LEVEL_INFO
+ * to drop the debug messages of the transfer paths from the binary. */
+#ifndef USBI_MAX_LOG_LEVEL
+#define USBI_MAX_LOG_LEVEL	LIBUSB_LOG_LEVEL_DEBUG
+#endif
+
+/* The highest level that any context or the environment has enabled. The
+ * arguments of a message above it are not even evaluated. */
+extern usbi_atomic_t usbi_log_level_max;
+
+#define _usbi_log(ctx, level, ...)						\
+	do {									\
+		if ((level) <= USBI_MAX_LOG_LEVEL &&				\
+		    UNLIKELY((level) <= usbi_atomic_load(&usbi_log_level_max)))	\
+			usbi_log(ctx, level, __func__, __VA_ARGS__);		\
+	} while (0)
 
 #define usbi_err(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_ERROR, __VA_ARGS__)
 #define usbi_warn(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_WARNING, __VA_ARGS__)
@@ -311,6 +334,10 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 #define IS_XFERIN(xfer)		(0 != ((xfer)->endpoint & LIBUSB_ENDPOINT_IN))
 #define IS_XFEROUT(xfer)	(!IS_XFERIN(xfer))
 
+/* number of buckets (a power of 2) of the per-context device index */
+#define USBI_DEV_HASH_BITS	6
+#define USBI_DEV_HASH_SIZE	(1U << USBI_DEV_HASH_BITS)
+
 struct libusb_context {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	enum libusb_log_level debug;
@@ -318,6 +345,12 @@ struct libusb_context {
 	libusb_log_cb log_handler;
 #endif
 
+	/* set while LIBUSB_OPTION_ENDPOINT_STATS is enabled */
+	int endpoint_stats;
+
+	/* busy-poll window in microseconds, see LIBUSB_OPTION_BUSY_POLL */
+	unsigned int busy_poll_us;
+
 	/* used for signalling occurrence of an internal event. */
 	usbi_event_t event;
 
@@ -325,11 +358,24 @@ struct libusb_context {
 	/* used for timeout handling, if supported by OS.
 	 * this timer is maintained to trigger on the next pending timeout */
 	usbi_timer_t timer;
+
+	/* expiry the timer is armed for, or cleared while it is disarmed.
+	 * protected by flying_transfers_lock */
+	struct timespec timer_deadline;
 #endif
 
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* usb_devs indexed by session ID, protected by usb_devs_lock */
+	struct list_head usb_devs_hash[USBI_DEV_HASH_SIZE];
+	size_t num_usb_devs;
+
+	/* usb_devs indexed by idVendor and idProduct, protected by
+	 * usb_devs_lock. only maintained on backends with hotplug support, as
+	 * other backends connect devices before reading their descriptors */
+	struct list_head usb_devs_id_hash[USBI_DEV_HASH_SIZE];
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -340,11 +386,14 @@ struct libusb_context {
 	libusb_hotplug_callback_handle next_hotplug_cb_handle;
 	usbi_mutex_t hotplug_cbs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* this is a list of in-flight transfer handles, in no particular order.
+	 * transfers with a timeout are additionally kept in timeout_heap, a
+	 * binary min-heap ordered by expiration, so the next timeout is always
+	 * at timeout_heap[0]. both are protected by flying_transfers_lock. */
 	struct list_head flying_transfers;
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
 	/* Note paths taking both this and usbi_transfer->lock must always
 	 * take this lock first */
 	usbi_mutex_t flying_transfers_lock;
@@ -394,10 +443,23 @@ struct libusb_context {
 	void *event_data;
 	unsigned int event_data_cnt;
 
+#ifdef HAVE_EPOLL
+	/* The epoll instance that event sources are registered with as they are
+	 * added, so that waiting does not depend on the number of sources. */
+	int epoll_fd;
+#endif
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* A lock-free stack of transfers completed by the backend, linked through
+	 * usbi_transfer.completed_next and pushed in reverse order. Only the
+	 * push that makes it non-empty takes event_data_lock to raise
+	 * USBI_EVENT_TRANSFER_COMPLETED. */
+	usbi_atomic_ptr_t completed_queue;
+
+	/* A list of pending completed transfers, in completion order, taken from
+	 * completed_queue by the event handler. Protected by event_data_lock. */
 	struct list_head completed_transfers;
 
 	struct list_head list;
@@ -450,11 +512,15 @@ static inline void usbi_end_event_handling(struct libusb_context *ctx)
 }
 
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and config_cache, everything else is finalized
+	 * at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
+	/* parsed configuration descriptors in the order they were first used,
+	 * each holding a reference. see libusb_get_config_descriptor() */
+	struct libusb_config_descriptor *config_cache[USB_MAXCONFIG];
+
 	struct libusb_context *ctx;
 	struct libusb_device *parent_dev;
 
@@ -464,17 +530,38 @@ struct libusb_device {
 	enum libusb_speed speed;
 
 	struct list_head list;
+	struct list_head hash_list;
+	struct list_head id_hash_list;
 	unsigned long session_data;
 
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 };
 
+/* maps an endpoint address to one of USB_MAXENDPOINTS statistics slots */
+#define USBI_EP_STATS_INDEX(endpoint) \
+	(((endpoint) & 0x0f) | (((endpoint) & LIBUSB_ENDPOINT_IN) >> 3))
+
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces and ep_stats */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* per-endpoint statistics, indexed by USBI_EP_STATS_INDEX(). allocated
+	 * on the first completion while the context collects statistics */
+	struct libusb_endpoint_stats *ep_stats;
+
+	/* events_lock is held by the thread handling the events of a handle
+	 * that has been taken out of the context's event handling, see
+	 * libusb_set_dedicated_event_handling() */
+	usbi_mutex_t events_lock;
+	int dedicated_events;
+
+	/* transfers of this handle on the context's flying_transfers list,
+	 * linked through usbi_transfer.handle_list. protected by the context's
+	 * flying_transfers_lock */
+	struct list_head flying_transfers;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
@@ -527,12 +614,21 @@ void usbi_get_real_time(struct timespec *tp);
 struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
+	struct list_head handle_list;	/* on dev_handle->flying_transfers */
 	struct list_head completed_list;
+	struct usbi_transfer *completed_next;
 	struct timespec timeout;
 	int transferred;
 	uint32_t stream_id;
+	const struct libusb_bulk_iovec *bulk_iov; /* NULL unless vectored */
+	int bulk_iov_count;
+	struct timespec submit_time;	/* only set when collecting statistics */
+	unsigned int num_requests;	/* OS requests the backend split the
+					 * transfer into, 0 if not reported */
 	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
 	uint32_t timeout_flags; /* Protected by the flying_stransfers_lock */
+	unsigned int timeout_heap_index; /* 1-based, 0 when not in the heap.
+					  * Protected by the flying_transfers_lock */
 
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
@@ -568,6 +664,10 @@ enum usbi_transfer_timeout_flags {
 
 	/* The transfer timeout was successfully processed */
 	USBI_TRANSFER_TIMED_OUT = 1U << 2,
+
+	/* The transfer is part of the batch libusb_submit_transfers() is
+	 * adding to the flying list. Only set while that holds the lock */
+	USBI_TRANSFER_IN_BATCH = 1U << 3,
 };
 
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)	\
@@ -668,12 +768,16 @@ union usbi_bos_desc_buf {
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_transfer_pool_drain(void);
+void usbi_remove_transfer_timeout(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
+void usbi_free_config_cache(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
@@ -739,6 +843,43 @@ int usbi_alloc_event_data(struct libusb_context *ctx);
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms);
 
+#ifdef HAVE_EPOLL
+int usbi_init_event_data(struct libusb_context *ctx);
+void usbi_free_event_data(struct libusb_context *ctx);
+int usbi_register_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source);
+void usbi_unregister_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source);
+#else
+/* event sources are only tracked in the context's list; the event data is
+ * rebuilt from it by usbi_alloc_event_data() whenever it changes */
+static inline int usbi_init_event_data(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+	return 0;
+}
+
+static inline void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free(ctx->event_data);
+}
+
+static inline int usbi_register_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	UNUSED(ctx);
+	UNUSED(ievent_source);
+	return 0;
+}
+
+static inline void usbi_unregister_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	UNUSED(ctx);
+	UNUSED(ievent_source);
+}
+#endif
+
 /* accessor functions for structure private data */
 
 static inline void *usbi_get_context_priv(struct libusb_context *ctx)
@@ -1277,6 +1418,38 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		void *event_data, unsigned int count, unsigned int num_ready);
 
+	/* Take the event sources of a device handle out of the context's set
+	 * (enable != 0) or put them back (enable == 0). Optional.
+	 *
+	 * While taken out, the events of the handle are only processed by
+	 * handle_device_events() below. Implementing this function requires
+	 * implementing handle_device_events() too.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_dedicated_events)(struct libusb_device_handle *dev_handle,
+		int enable);
+
+	/* Wait up to timeout_ms milliseconds for events of a device handle whose
+	 * event sources have been taken out of the context's set, and handle
+	 * them like handle_events() does. Optional.
+	 *
+	 * This function is called with the handle's events_lock held, but
+	 * without the event handling lock of the context, so it may run
+	 * concurrently with handle_events() and with the handle_device_events()
+	 * of other handles. It must not take locks that handle_events() holds
+	 * while calling back into the library.
+	 *
+	 * Return 0 on success (including when no events arrived in time),
+	 * LIBUSB_ERROR_NO_DEVICE if the device has been disconnected, or another
+	 * LIBUSB_ERROR code on failure.
+	 */
+	int (*handle_device_events)(struct libusb_device_handle *dev_handle,
+		int timeout_ms);
+
 	/* Handle transfer completion. Optional.
 	 *
 	 * Provide this function when there are no event sources available that
@@ -1328,6 +1501,13 @@ struct usbi_os_backend {
 };
 
 extern const struct usbi_os_backend usbi_backend;
+#ifdef PLATFORM_POSIX
+extern const struct usbi_os_backend usbi_loopback_backend;
+#endif
+
+/* the backend used by all contexts. this is the platform's usbi_backend
+ * unless another one was selected while no context existed */
+extern const struct usbi_os_backend *usbi_active_backend;
 
 #define for_each_context(c) \
 	for_each_helper(c, &active_contexts_list, struct libusb_context)
@@ -1353,6 +1533,12 @@ extern const struct usbi_os_backend usbi_backend;
 #define for_each_transfer_safe(ctx, t, n) \
 	__for_each_transfer_safe(&(ctx)->flying_transfers, t, n)
 
+#define for_each_handle_transfer(h, t) \
+	list_for_each_entry(t, &(h)->flying_transfers, handle_list, struct usbi_transfer)
+
+#define for_each_handle_transfer_safe(h, t, n) \
+	list_for_each_entry_safe(t, n, &(h)->flying_transfers, handle_list, struct usbi_transfer)
+
 #define __for_each_completed_transfer_safe(list, t, n) \
 	list_for_each_entry_safe(t, n, (list), completed_list, struct usbi_transfer)
 
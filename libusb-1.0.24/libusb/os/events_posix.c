@@ -22,6 +22,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
 #endif
@@ -186,6 +189,208 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 }
 #endif
 
+/* Busy polling (LIBUSB_OPTION_BUSY_POLL) checks for events with a zero timeout
+ * until the deadline set here has passed, and only then blocks for whatever is
+ * left of the caller's timeout. The window never extends past that timeout. */
+static void busy_poll_deadline(struct libusb_context *ctx, int *timeout_ms,
+	struct timespec *deadline)
+{
+	unsigned int window_us = ctx->busy_poll_us;
+
+	if (*timeout_ms > 0) {
+		if (window_us / 1000U >= (unsigned int)*timeout_ms)
+			window_us = (unsigned int)*timeout_ms * 1000U;
+		*timeout_ms -= (int)(window_us / 1000U);
+	}
+
+	usbi_get_monotonic_time(deadline);
+	deadline->tv_sec += window_us / 1000000U;
+	deadline->tv_nsec += (long)(window_us % 1000000U) * 1000L;
+	if (deadline->tv_nsec >= NSEC_PER_SEC) {
+		deadline->tv_nsec -= NSEC_PER_SEC;
+		deadline->tv_sec++;
+	}
+}
+
+static int busy_poll_expired(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	return !TIMESPEC_CMP(&now, deadline, <);
+}
+
+#ifdef HAVE_EPOLL
+/* With epoll the event sources stay registered with the kernel between waits,
+ * and each epoll_event carries a pointer to its usbi_event_source. The event
+ * data is a single allocation holding an array of epoll_event structures for
+ * epoll_wait() to fill in, followed by the compact array of pollfds for the
+ * sources that are ready that is handed to the backend. */
+static inline struct pollfd *epoll_ready_fds(struct libusb_context *ctx)
+{
+	return (struct pollfd *)((struct epoll_event *)ctx->event_data + ctx->event_data_cnt);
+}
+
+int usbi_init_event_data(struct libusb_context *ctx)
+{
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd == -1) {
+		usbi_err(ctx, "failed to create epoll instance, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	if (close(ctx->epoll_fd) == -1)
+		usbi_warn(ctx, "failed to close epoll instance, errno=%d", errno);
+	free(ctx->event_data);
+	ctx->event_data = NULL;
+}
+
+int usbi_register_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct epoll_event event;
+
+	/* the poll() and epoll event bits share their values on Linux */
+	event.events = (uint32_t)ievent_source->data.poll_events;
+	event.data.ptr = ievent_source;
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ievent_source->data.os_handle, &event) == -1) {
+		usbi_err(ctx, "failed to add fd %d to epoll instance, errno=%d",
+			 ievent_source->data.os_handle, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_unregister_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	/* the event source may still be reported by a wait that is already in
+	 * progress, so its memory is kept until the next handle_events() */
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, ievent_source->data.os_handle, NULL) == -1)
+		usbi_warn(ctx, "failed to remove fd %d from epoll instance, errno=%d",
+			  ievent_source->data.os_handle, errno);
+}
+
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	struct usbi_event_source *ievent_source;
+	void *event_data;
+	unsigned int cnt = 0;
+
+	for_each_event_source(ctx, ievent_source)
+		cnt++;
+
+	if (cnt == ctx->event_data_cnt && ctx->event_data)
+		return 0;
+
+	event_data = realloc(ctx->event_data,
+		cnt * (sizeof(struct epoll_event) + sizeof(struct pollfd)));
+	if (!event_data)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ctx->event_data = event_data;
+	ctx->event_data_cnt = cnt;
+	return 0;
+}
+
+static int event_source_removed(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct usbi_event_source *iremoved;
+
+	for_each_removed_event_source(ctx, iremoved) {
+		if (iremoved == ievent_source)
+			return 1;
+	}
+
+	return 0;
+}
+
+int usbi_wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct epoll_event *events = ctx->event_data;
+	struct pollfd *fds = epoll_ready_fds(ctx);
+	int event_fd = USBI_EVENT_OS_HANDLE(&ctx->event);
+#ifdef HAVE_OS_TIMER
+	int timer_fd = usbi_using_timer(ctx) ? USBI_TIMER_OS_HANDLE(&ctx->timer) : -1;
+#endif
+	int n, num_events, num_ready = 0;
+
+	num_events = 0;
+	if (ctx->busy_poll_us && timeout_ms) {
+		struct timespec deadline;
+
+		busy_poll_deadline(ctx, &timeout_ms, &deadline);
+		do {
+			num_events = epoll_wait(ctx->epoll_fd, events,
+				(int)ctx->event_data_cnt, 0);
+		} while (!num_events && !busy_poll_expired(&deadline));
+	}
+
+	if (!num_events) {
+		usbi_dbg("epoll_wait() %u fds with timeout in %dms", ctx->event_data_cnt, timeout_ms);
+		num_events = epoll_wait(ctx->epoll_fd, events, (int)ctx->event_data_cnt, timeout_ms);
+		usbi_dbg("epoll_wait() returned %d", num_events);
+	}
+	if (num_events == 0) {
+		if (usbi_using_timer(ctx))
+			goto done;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_events == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	for (n = 0; n < num_events; n++) {
+		struct usbi_event_source *ievent_source = events[n].data.ptr;
+		int fd = ievent_source->data.os_handle;
+
+		if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED &&
+		    event_source_removed(ctx, ievent_source)) {
+			/* event source was removed after it was reported ready.
+			 * ignore the raised events as they are no longer relevant. */
+			usbi_dbg("fd %d was removed, ignoring raised events", fd);
+			continue;
+		}
+
+		if (fd == event_fd) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (fd == timer_fd) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+
+		fds[num_ready].fd = fd;
+		fds[num_ready].events = ievent_source->data.poll_events;
+		fds[num_ready].revents = (short)events[n].events;
+		num_ready++;
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (num_ready) {
+		reported_events->event_data = fds;
+		reported_events->event_data_count = (unsigned int)num_ready;
+	}
+
+done:
+	reported_events->num_ready = num_ready;
+	return LIBUSB_SUCCESS;
+}
+#else
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
 	struct usbi_event_source *ievent_source;
@@ -222,9 +427,21 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	usbi_nfds_t nfds = (usbi_nfds_t)ctx->event_data_cnt;
 	int internal_fds, num_ready;
 
-	usbi_dbg("poll() %u fds with timeout in %dms", (unsigned int)nfds, timeout_ms);
-	num_ready = poll(fds, nfds, timeout_ms);
-	usbi_dbg("poll() returned %d", num_ready);
+	num_ready = 0;
+	if (ctx->busy_poll_us && timeout_ms) {
+		struct timespec deadline;
+
+		busy_poll_deadline(ctx, &timeout_ms, &deadline);
+		do {
+			num_ready = poll(fds, nfds, 0);
+		} while (!num_ready && !busy_poll_expired(&deadline));
+	}
+
+	if (!num_ready) {
+		usbi_dbg("poll() %u fds with timeout in %dms", (unsigned int)nfds, timeout_ms);
+		num_ready = poll(fds, nfds, timeout_ms);
+		usbi_dbg("poll() returned %d", num_ready);
+	}
 	if (num_ready == 0) {
 		if (usbi_using_timer(ctx))
 			goto done;
@@ -298,3 +515,4 @@ done:
 	reported_events->num_ready = num_ready;
 	return LIBUSB_SUCCESS;
 }
+#endif
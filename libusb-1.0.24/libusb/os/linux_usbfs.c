@@ -123,6 +123,14 @@ struct config_descriptor {
 	size_t actual_len;
 };
 
+struct linux_context_priv {
+	/* open device handles indexed by usbfs fd, so that op_handle_events()
+	 * can find the handle for a ready fd directly. protected by the
+	 * context's open_devs_lock */
+	struct libusb_device_handle **fd_handles;
+	int num_fd_handles;
+};
+
 struct linux_device_priv {
 	char *sysfs_dir;
 	void *descriptors;
@@ -135,9 +143,19 @@ struct linux_device_handle_priv {
 	int fd;
 	int fd_removed;
 	int fd_keep;
+	int fd_dedicated;
 	uint32_t caps;
+	int reap_batch;
 };
 
+/* Bounds on the number of URBs reaped per wakeup of a handle before going back
+ * to poll, so that one busy device cannot starve the others. The batch doubles
+ * while wakeups keep hitting the limit and halves while they only find a few
+ * completions, following the completion rate of the handle. */
+#define REAP_BATCH_MIN		8
+#define REAP_BATCH_DEFAULT	32
+#define REAP_BATCH_MAX		512
+
 enum reap_action {
 	NORMAL = 0,
 	/* submission failed after the first URB, so await cancellation/completion
@@ -167,6 +185,10 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* storage for the common single-URB control and bulk transfers, saving
+	 * an allocation per submission */
+	struct usbfs_urb inline_urb;
 };
 
 static int get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
@@ -414,7 +436,12 @@ static int op_init(struct libusb_context *ctx)
 
 static void op_exit(struct libusb_context *ctx)
 {
-	UNUSED(ctx);
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	free(cpriv->fd_handles);
+	cpriv->fd_handles = NULL;
+	cpriv->num_fd_handles = 0;
+
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	assert(init_count != 0);
 	if (!--init_count) {
@@ -1304,6 +1331,39 @@ static int linux_default_scan_devices(struct libusb_context *ctx)
 }
 #endif
 
+/* record (or with a NULL handle, forget) the handle owning a usbfs fd */
+static int set_fd_handle(struct libusb_context *ctx, int fd,
+	struct libusb_device_handle *handle)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (fd >= cpriv->num_fd_handles) {
+		struct libusb_device_handle **fd_handles;
+		int num_fd_handles;
+
+		if (!handle)
+			goto out;
+
+		num_fd_handles = MAX(fd + 1, 2 * cpriv->num_fd_handles);
+		fd_handles = realloc(cpriv->fd_handles, num_fd_handles * sizeof(*fd_handles));
+		if (!fd_handles) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		memset(fd_handles + cpriv->num_fd_handles, 0,
+		       (num_fd_handles - cpriv->num_fd_handles) * sizeof(*fd_handles));
+		cpriv->fd_handles = fd_handles;
+		cpriv->num_fd_handles = num_fd_handles;
+	}
+	cpriv->fd_handles[fd] = handle;
+out:
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return r;
+}
+
 static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
@@ -1320,7 +1380,15 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	r = set_fd_handle(HANDLE_CTX(handle), fd, handle);
+	if (r < 0)
+		return r;
+
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r < 0)
+		set_fd_handle(HANDLE_CTX(handle), fd, NULL);
+
+	return r;
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1404,6 +1472,8 @@ static void op_close(struct libusb_device_handle *dev_handle)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(dev_handle);
 
+	set_fd_handle(HANDLE_CTX(dev_handle), hpriv->fd, NULL);
+
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_event_source(HANDLE_CTX(dev_handle), hpriv->fd);
@@ -1877,6 +1947,23 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 	tpriv->iso_urbs = NULL;
 }
 
+static struct usbfs_urb *alloc_urbs(struct linux_transfer_priv *tpriv, int num_urbs)
+{
+	if (num_urbs == 1) {
+		memset(&tpriv->inline_urb, 0, sizeof(tpriv->inline_urb));
+		return &tpriv->inline_urb;
+	}
+
+	return calloc(num_urbs, sizeof(struct usbfs_urb));
+}
+
+static void free_urbs(struct linux_transfer_priv *tpriv)
+{
+	if (tpriv->urbs != &tpriv->inline_urb)
+		free(tpriv->urbs);
+	tpriv->urbs = NULL;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -1884,14 +1971,23 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
+	struct libusb_bulk_iovec single = { transfer->buffer, transfer->length };
+	const struct libusb_bulk_iovec *iov = &single;
+	int iov_count = 1, seg = 0, seg_offset = 0;
 	struct usbfs_urb *urbs;
 	int is_out = IS_XFEROUT(transfer);
 	int bulk_buffer_len, use_bulk_continuation;
 	int num_urbs;
-	int last_urb_partial = 0;
 	int r;
 	int i;
 
+	/* a plain transfer is a single segment; a vectored one gets at least
+	 * one URB per segment */
+	if (itransfer->bulk_iov) {
+		iov = itransfer->bulk_iov;
+		iov_count = itransfer->bulk_iov_count;
+	}
+
 	/*
 	 * Older versions of usbfs place a 16kb limit on bulk URBs. We work
 	 * around this by splitting large transfers into 16k blocks, and then
@@ -1934,20 +2030,23 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	num_urbs = transfer->length / bulk_buffer_len;
+	if (iov_count > 1 && (hpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+		use_bulk_continuation = 1;
 
-	if (transfer->length == 0) {
+	num_urbs = 0;
+	for (i = 0; i < iov_count; i++)
+		num_urbs += iov[i].length / bulk_buffer_len +
+			    (iov[i].length % bulk_buffer_len ? 1 : 0);
+	if (num_urbs == 0)
 		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
-	}
+
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	urbs = alloc_urbs(tpriv, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
+	itransfer->num_requests = (unsigned int)num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
@@ -1970,19 +2069,20 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+
+		/* move on to the next segment with data left in it */
+		while (seg_offset == iov[seg].length && seg < iov_count - 1) {
+			seg++;
+			seg_offset = 0;
+		}
+		urb->buffer = iov[seg].buffer + seg_offset;
+		urb->buffer_length = MIN(iov[seg].length - seg_offset, bulk_buffer_len);
+		seg_offset += urb->buffer_length;
 
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
 
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
 
@@ -2008,8 +2108,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg("first URB failed, easy peasy");
-			free(urbs);
-			tpriv->urbs = NULL;
+			free_urbs(tpriv);
 			return r;
 		}
 
@@ -2100,6 +2199,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	tpriv->iso_urbs = urbs;
 	tpriv->num_urbs = num_urbs;
+	itransfer->num_requests = (unsigned int)num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->iso_packet_offset = 0;
@@ -2209,11 +2309,10 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
-	if (!urb)
-		return LIBUSB_ERROR_NO_MEM;
+	urb = alloc_urbs(tpriv, 1);
 	tpriv->urbs = urb;
 	tpriv->num_urbs = 1;
+	itransfer->num_requests = 1;
 	tpriv->reap_action = NORMAL;
 
 	urb->usercontext = itransfer;
@@ -2224,8 +2323,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -2294,10 +2392,8 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		if (tpriv->urbs)
+			free_urbs(tpriv);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (tpriv->iso_urbs) {
@@ -2347,7 +2443,9 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
-			if (urb->buffer != target) {
+			/* the segments of a vectored transfer are not contiguous,
+			 * so its surplus data stays where it landed */
+			if (urb->buffer != target && !itransfer->bulk_iov) {
 				usbi_dbg("moving surplus data from offset %zu to offset %zu",
 					 (unsigned char *)urb->buffer - transfer->buffer,
 					 target - transfer->buffer);
@@ -2439,8 +2537,7 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return tpriv->reap_action == CANCELLED ?
 		usbi_handle_transfer_cancellation(itransfer) :
@@ -2582,8 +2679,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
@@ -2622,8 +2718,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
@@ -2667,9 +2762,61 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* handle the events reported for the usbfs fd of a handle. returns
+ * LIBUSB_ERROR_NO_DEVICE once the device has gone away */
+static int handle_fd_events(struct libusb_device_handle *handle, short revents)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	int reap_batch, reap_count;
+	int r;
+
+	if (revents & POLLERR) {
+		/* remove the fd from the pollfd set so that it doesn't continuously
+		 * trigger an event, and flag that it has been removed so op_close()
+		 * doesn't try to remove it a second time */
+		if (!hpriv->fd_removed) {
+			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+			hpriv->fd_removed = 1;
+		}
+		hpriv->fd_dedicated = 0;
+
+		/* device will still be marked as attached if hotplug monitor thread
+		 * hasn't processed remove event yet */
+		usbi_mutex_static_lock(&linux_hotplug_lock);
+		if (handle->dev->attached)
+			linux_device_disconnected(handle->dev->bus_number,
+						  handle->dev->device_address);
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+		if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
+			do {
+				r = reap_for_handle(handle);
+			} while (r == 0);
+		}
+
+		usbi_handle_disconnect(handle);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	reap_batch = hpriv->reap_batch ? hpriv->reap_batch : REAP_BATCH_DEFAULT;
+	reap_count = 0;
+	do {
+		r = reap_for_handle(handle);
+	} while (r == 0 && ++reap_count < reap_batch);
+
+	if (r == 0)
+		reap_batch = MIN(reap_batch * 2, REAP_BATCH_MAX);
+	else if (reap_count < reap_batch / 4)
+		reap_batch = MAX(reap_batch / 2, REAP_BATCH_MIN);
+	hpriv->reap_batch = reap_batch;
+
+	return r == 1 ? 0 : r;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 	struct pollfd *fds = event_data;
 	unsigned int n;
 	int r;
@@ -2677,59 +2824,23 @@ static int op_handle_events(struct libusb_context *ctx,
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (n = 0; n < count && num_ready > 0; n++) {
 		struct pollfd *pollfd = &fds[n];
-		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
-		int reap_count;
+		struct libusb_device_handle *handle = NULL;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		for_each_open_device(ctx, handle) {
-			hpriv = usbi_get_device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
+		if (pollfd->fd >= 0 && pollfd->fd < cpriv->num_fd_handles)
+			handle = cpriv->fd_handles[pollfd->fd];
 
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		if (!handle) {
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
 			continue;
 		}
 
-		if (pollfd->revents & POLLERR) {
-			/* remove the fd from the pollfd set so that it doesn't continuously
-			 * trigger an event, and flag that it has been removed so op_close()
-			 * doesn't try to remove it a second time */
-			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
-			hpriv->fd_removed = 1;
-
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			if (handle->dev->attached)
-				linux_device_disconnected(handle->dev->bus_number,
-							  handle->dev->device_address);
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
-
-			if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
-				do {
-					r = reap_for_handle(handle);
-				} while (r == 0);
-			}
-
-			usbi_handle_disconnect(handle);
-			continue;
-		}
-
-		reap_count = 0;
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0 && ++reap_count <= 25);
-
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
+		r = handle_fd_events(handle, pollfd->revents);
+		if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE)
 			goto out;
 	}
 
@@ -2739,9 +2850,66 @@ out:
 	return r;
 }
 
+static int op_set_dedicated_events(struct libusb_device_handle *handle,
+	int enable)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	int r;
+
+	if (enable) {
+		/* the fd is only removed early after the device went away */
+		if (hpriv->fd_removed)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+		hpriv->fd_removed = 1;
+		hpriv->fd_dedicated = 1;
+		return LIBUSB_SUCCESS;
+	}
+
+	/* nothing to give back if the device went away in the meantime */
+	if (!hpriv->fd_dedicated)
+		return LIBUSB_SUCCESS;
+
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r)
+		return r;
+
+	hpriv->fd_removed = 0;
+	hpriv->fd_dedicated = 0;
+	return LIBUSB_SUCCESS;
+}
+
+static int op_handle_device_events(struct libusb_device_handle *handle,
+	int timeout_ms)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct pollfd pollfd;
+	int r;
+
+	if (!hpriv->fd_dedicated)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	pollfd.fd = hpriv->fd;
+	pollfd.events = POLLOUT;
+	pollfd.revents = 0;
+
+	r = poll(&pollfd, 1, timeout_ms);
+	if (r == 0)
+		return LIBUSB_SUCCESS;
+	if (r < 0) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(HANDLE_CTX(handle), "poll failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return handle_fd_events(handle, pollfd.revents);
+}
+
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_SUPPORTS_BULK_IOV,
 	.init = op_init,
 	.exit = op_exit,
 	.set_option = op_set_option,
@@ -2779,7 +2947,10 @@ const struct usbi_os_backend usbi_backend = {
 	.clear_transfer_priv = op_clear_transfer_priv,
 
 	.handle_events = op_handle_events,
+	.set_dedicated_events = op_set_dedicated_events,
+	.handle_device_events = op_handle_device_events,
 
+	.context_priv_size = sizeof(struct linux_context_priv),
 	.device_priv_size = sizeof(struct linux_device_priv),
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
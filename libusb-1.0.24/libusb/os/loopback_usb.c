@@ -0,0 +1,913 @@
+/* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
+/*
+ * Loopback backend for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libusbi.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * @defgroup libusb_loopback Loopback devices
+ * This page details how to run libusb against virtual devices.
+ *
+ * On POSIX platforms libusb includes a loopback backend which replaces the
+ * platform's USB stack with devices that only exist inside the process. It
+ * is selected by setting the LIBUSB_BACKEND environment variable to
+ * "loopback" before the first context is initialized.
+ *
+ * Devices are added to a context with libusb_loopback_add_device(), which
+ * raises the usual hotplug events. Every device has a single configuration
+ * with one vendor specific interface holding the endpoints that were
+ * described when adding it. IN endpoints produce a counting byte pattern and
+ * OUT endpoints discard what they are sent, each at a configurable rate and
+ * latency. Control requests for the device and configuration descriptors are
+ * answered, any other control request succeeds with zeroed data. Device
+ * handles support libusb_set_dedicated_event_handling().
+ *
+ * Errors can be injected on any endpoint with
+ * libusb_loopback_inject_error(), and libusb_loopback_disconnect() makes a
+ * device go away as if it had been unplugged. Together this allows
+ * exercising and benchmarking the transfer, event handling and hotplug code
+ * of libusb and of applications in a reproducible way on machines without
+ * any USB hardware.
+ */
+
+/* the default control endpoint plus up to 30 others */
+#define LOOPBACK_MAX_ENDPOINTS		31
+#define LOOPBACK_BUS_NUMBER		1
+#define LOOPBACK_MAX_ADDRESS		127
+#define LOOPBACK_CONFIG_DESC_SIZE	(LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE + \
+					 (LOOPBACK_MAX_ENDPOINTS - 1) * LIBUSB_DT_ENDPOINT_SIZE)
+
+struct loopback_endpoint {
+	struct libusb_loopback_endpoint desc;
+	struct timespec busy_until;	/* when the data queued so far has moved */
+	enum libusb_transfer_status inject_status;
+	int inject_count;
+	uint8_t next_byte;		/* next byte of the IN data pattern */
+};
+
+struct loopback_context_priv {
+	/* protects everything below as well as the state of all devices and
+	 * transfers of the context */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	pthread_t thread;
+	int stop;
+
+	/* transfers waiting to complete, sorted by their due time */
+	struct list_head pending;
+	uint8_t next_address;
+};
+
+struct loopback_device_priv {
+	unsigned char device_desc[LIBUSB_DT_DEVICE_SIZE];
+	unsigned char config_desc[LOOPBACK_CONFIG_DESC_SIZE];
+	uint16_t config_desc_len;
+	int num_endpoints;
+	struct loopback_endpoint endpoints[LOOPBACK_MAX_ENDPOINTS];
+	int disconnected;
+};
+
+struct loopback_device_handle_priv {
+	/* completions of a handle with dedicated event handling, waiting for
+	 * loopback_handle_device_events(). protected by the context's lock */
+	struct list_head completed;
+	usbi_cond_t cond;
+	int dedicated;
+};
+
+struct loopback_transfer_priv {
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	struct timespec due;
+	enum libusb_transfer_status status;
+	unsigned int length;
+	uint8_t first_byte;
+	int pending;
+};
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec += (time_t)(ns / NSEC_PER_SEC);
+	ts->tv_nsec += (long)(ns % NSEC_PER_SEC);
+	if (ts->tv_nsec >= NSEC_PER_SEC) {
+		ts->tv_nsec -= NSEC_PER_SEC;
+		ts->tv_sec++;
+	}
+}
+
+static struct loopback_endpoint *find_endpoint(struct loopback_device_priv *dpriv,
+	unsigned char endpoint)
+{
+	int i;
+
+	if (!(endpoint & ~LIBUSB_ENDPOINT_DIR_MASK))
+		return &dpriv->endpoints[0];
+
+	for (i = 1; i < dpriv->num_endpoints; i++) {
+		if (dpriv->endpoints[i].desc.bEndpointAddress == endpoint)
+			return &dpriv->endpoints[i];
+	}
+
+	return NULL;
+}
+
+/* hand a finished transfer to the thread handling the events of its device
+ * handle if that has dedicated event handling. returns 0 if the completion
+ * is for the context's event handling instead.
+ * must be called with the context's lock held. */
+static int queue_dedicated_completion(struct loopback_transfer_priv *tpriv)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(tpriv->itransfer);
+	struct loopback_device_handle_priv *hpriv =
+		usbi_get_device_handle_priv(transfer->dev_handle);
+
+	if (!hpriv->dedicated)
+		return 0;
+
+	list_add_tail(&tpriv->list, &hpriv->completed);
+	usbi_cond_broadcast(&hpriv->cond);
+	return 1;
+}
+
+static void *loopback_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct loopback_transfer_priv *tpriv, *next;
+	struct list_head due;
+	struct timespec now;
+
+	usbi_dbg("loopback thread entering loop");
+
+	usbi_mutex_lock(&cpriv->lock);
+	while (!cpriv->stop) {
+		if (list_empty(&cpriv->pending)) {
+			usbi_cond_wait(&cpriv->cond, &cpriv->lock);
+			continue;
+		}
+
+		usbi_get_monotonic_time(&now);
+		tpriv = list_first_entry(&cpriv->pending, struct loopback_transfer_priv, list);
+		if (TIMESPEC_CMP(&tpriv->due, &now, >)) {
+			struct timespec delta;
+			struct timeval tv;
+
+			TIMESPEC_SUB(&tpriv->due, &now, &delta);
+			TIMESPEC_TO_TIMEVAL(&tv, &delta);
+			usbi_cond_timedwait(&cpriv->cond, &cpriv->lock, &tv);
+			continue;
+		}
+
+		/* take every transfer that is due off the list, then signal their
+		 * completion without holding the lock */
+		list_init(&due);
+		while (!list_empty(&cpriv->pending)) {
+			tpriv = list_first_entry(&cpriv->pending, struct loopback_transfer_priv, list);
+			if (TIMESPEC_CMP(&tpriv->due, &now, >))
+				break;
+			list_del(&tpriv->list);
+			tpriv->pending = 0;
+			if (!queue_dedicated_completion(tpriv))
+				list_add_tail(&tpriv->list, &due);
+		}
+		usbi_mutex_unlock(&cpriv->lock);
+
+		/* a transfer may be resubmitted as soon as its completion has been
+		 * signalled, so never look at one again after that */
+		list_for_each_entry_safe(tpriv, next, &due, list, struct loopback_transfer_priv)
+			usbi_signal_transfer_completion(tpriv->itransfer);
+
+		usbi_mutex_lock(&cpriv->lock);
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	usbi_dbg("loopback thread exiting");
+	return NULL;
+}
+
+static int loopback_init(struct libusb_context *ctx)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+	int r;
+
+	usbi_mutex_init(&cpriv->lock);
+	usbi_cond_init(&cpriv->cond);
+	list_init(&cpriv->pending);
+	cpriv->next_address = 1;
+
+	r = pthread_create(&cpriv->thread, NULL, loopback_thread_main, ctx);
+	if (r != 0) {
+		usbi_err(ctx, "failed to create loopback thread (%d)", r);
+		usbi_cond_destroy(&cpriv->cond);
+		usbi_mutex_destroy(&cpriv->lock);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void loopback_exit(struct libusb_context *ctx)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+	int r;
+
+	usbi_mutex_lock(&cpriv->lock);
+	cpriv->stop = 1;
+	usbi_cond_broadcast(&cpriv->cond);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	r = pthread_join(cpriv->thread, NULL);
+	if (r)
+		usbi_warn(ctx, "failed to join loopback thread (%d)", r);
+
+	usbi_cond_destroy(&cpriv->cond);
+	usbi_mutex_destroy(&cpriv->lock);
+}
+
+static int loopback_get_active_config_descriptor(struct libusb_device *dev,
+	void *buffer, size_t len)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	len = MIN(len, dpriv->config_desc_len);
+	memcpy(buffer, dpriv->config_desc, len);
+	return (int)len;
+}
+
+static int loopback_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, void *buffer, size_t len)
+{
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return loopback_get_active_config_descriptor(dev, buffer, len);
+}
+
+static int loopback_open(struct libusb_device_handle *handle)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	struct loopback_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+	if (dpriv->disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	list_init(&hpriv->completed);
+	usbi_cond_init(&hpriv->cond);
+	return LIBUSB_SUCCESS;
+}
+
+static void loopback_close(struct libusb_device_handle *handle)
+{
+	struct loopback_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+	usbi_cond_destroy(&hpriv->cond);
+}
+
+static int loopback_get_configuration(struct libusb_device_handle *handle,
+	uint8_t *config)
+{
+	UNUSED(handle);
+	*config = 1;
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	UNUSED(handle);
+	return (config == 1 || config == -1) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_claim_interface(struct libusb_device_handle *handle,
+	uint8_t interface_number)
+{
+	UNUSED(handle);
+	return interface_number == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_release_interface(struct libusb_device_handle *handle,
+	uint8_t interface_number)
+{
+	UNUSED(handle);
+	return interface_number == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_set_interface_altsetting(struct libusb_device_handle *handle,
+	uint8_t interface_number, uint8_t altsetting)
+{
+	UNUSED(handle);
+	return (interface_number == 0 && altsetting == 0) ?
+		LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	int r;
+
+	usbi_mutex_lock(&cpriv->lock);
+	r = find_endpoint(dpriv, endpoint) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+	usbi_mutex_unlock(&cpriv->lock);
+	return r;
+}
+
+static int loopback_reset_device(struct libusb_device_handle *handle)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	return dpriv->disconnected ? LIBUSB_ERROR_NOT_FOUND : LIBUSB_SUCCESS;
+}
+
+static int loopback_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(transfer->dev_handle->dev);
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct loopback_endpoint *ep;
+	struct list_head *pos;
+	struct timespec now;
+	unsigned char endpoint;
+	unsigned int length;
+
+	if (transfer->length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup =
+			(struct libusb_control_setup *)transfer->buffer;
+
+		if ((size_t)transfer->length < LIBUSB_CONTROL_SETUP_SIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length = libusb_le16_to_cpu(setup->wLength);
+		if (length > (unsigned int)transfer->length - LIBUSB_CONTROL_SETUP_SIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		endpoint = 0;
+	} else {
+		length = (unsigned int)transfer->length;
+		endpoint = transfer->endpoint;
+		if (!(endpoint & ~LIBUSB_ENDPOINT_DIR_MASK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (dpriv->disconnected) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	ep = find_endpoint(dpriv, endpoint);
+	if (!ep) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	tpriv->itransfer = itransfer;
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	tpriv->length = length;
+	if (ep->inject_count) {
+		ep->inject_count--;
+		tpriv->status = ep->inject_status;
+		tpriv->length = 0;
+	}
+	tpriv->first_byte = ep->next_byte;
+	ep->next_byte = (uint8_t)(ep->next_byte + tpriv->length);
+	itransfer->num_requests = 1;
+
+	/* the data of a transfer moves once the endpoint is done with the data
+	 * of earlier transfers, and the transfer completes after the latency of
+	 * the endpoint on top of that */
+	usbi_get_monotonic_time(&now);
+	if (TIMESPEC_CMP(&ep->busy_until, &now, <))
+		ep->busy_until = now;
+	if (ep->desc.bandwidth)
+		timespec_add_ns(&ep->busy_until,
+			(uint64_t)tpriv->length * NSEC_PER_SEC / ep->desc.bandwidth);
+	tpriv->due = ep->busy_until;
+	timespec_add_ns(&tpriv->due, (uint64_t)ep->desc.latency_us * 1000);
+
+	if (!TIMESPEC_CMP(&tpriv->due, &now, >)) {
+		/* nothing to wait for, skip the thread */
+		tpriv->pending = 0;
+		if (queue_dedicated_completion(tpriv)) {
+			usbi_mutex_unlock(&cpriv->lock);
+			return LIBUSB_SUCCESS;
+		}
+		usbi_mutex_unlock(&cpriv->lock);
+		usbi_signal_transfer_completion(itransfer);
+		return LIBUSB_SUCCESS;
+	}
+
+	/* due times mostly increase, so search for the spot from the end */
+	pos = cpriv->pending.prev;
+	while (pos != &cpriv->pending &&
+	       TIMESPEC_CMP(&list_entry(pos, struct loopback_transfer_priv, list)->due, &tpriv->due, >))
+		pos = pos->prev;
+	list_add(&tpriv->list, pos);
+	tpriv->pending = 1;
+
+	/* wake up the thread if this is now the first transfer due */
+	if (pos == &cpriv->pending)
+		usbi_cond_broadcast(&cpriv->cond);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (!tpriv->pending) {
+		/* already on its way back */
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	list_del(&tpriv->list);
+	tpriv->pending = 0;
+	tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+	if (queue_dedicated_completion(tpriv)) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_SUCCESS;
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	usbi_signal_transfer_completion(itransfer);
+	return LIBUSB_SUCCESS;
+}
+
+static void fill_pattern(unsigned char *data, unsigned int length, uint8_t first_byte)
+{
+	unsigned int i;
+
+	for (i = 0; i < length; i++)
+		data[i] = (uint8_t)(first_byte + i);
+}
+
+/* returns the number of bytes of data produced for a control request */
+static unsigned int handle_control_request(struct libusb_device *dev,
+	struct libusb_control_setup *setup, unsigned char *data, unsigned int length)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	if (!(setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+		return length;
+
+	if (setup->bmRequestType == LIBUSB_ENDPOINT_IN &&
+	    setup->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR) {
+		uint16_t value = libusb_le16_to_cpu(setup->wValue);
+
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			length = MIN(length, (unsigned int)LIBUSB_DT_DEVICE_SIZE);
+			memcpy(data, dpriv->device_desc, length);
+			return length;
+		case LIBUSB_DT_CONFIG:
+			length = MIN(length, (unsigned int)dpriv->config_desc_len);
+			memcpy(data, dpriv->config_desc, length);
+			return length;
+		}
+	}
+
+	memset(data, 0, length);
+	return length;
+}
+
+static int loopback_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	enum libusb_transfer_status status = tpriv->status;
+	int i;
+
+	if (status == LIBUSB_TRANSFER_CANCELLED)
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED) {
+		switch (transfer->type) {
+		case LIBUSB_TRANSFER_TYPE_CONTROL:
+			itransfer->transferred = (int)handle_control_request(transfer->dev_handle->dev,
+				(struct libusb_control_setup *)transfer->buffer,
+				transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, tpriv->length);
+			break;
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+			for (i = 0; i < transfer->num_iso_packets; i++) {
+				transfer->iso_packet_desc[i].actual_length = transfer->iso_packet_desc[i].length;
+				transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+			}
+			/* fall through */
+		default:
+			if (IS_XFERIN(transfer))
+				fill_pattern(transfer->buffer, tpriv->length, tpriv->first_byte);
+			itransfer->transferred = (int)tpriv->length;
+		}
+	}
+
+	return usbi_handle_transfer_completion(itransfer, status);
+}
+
+static int loopback_set_dedicated_events(struct libusb_device_handle *handle,
+	int enable)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	struct loopback_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct loopback_transfer_priv *tpriv, *next;
+	struct list_head completed;
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (enable && dpriv->disconnected) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	hpriv->dedicated = enable;
+	/* completions nobody picked up go back to the context */
+	list_cut(&completed, &hpriv->completed);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	list_for_each_entry_safe(tpriv, next, &completed, list, struct loopback_transfer_priv)
+		usbi_signal_transfer_completion(tpriv->itransfer);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_handle_device_events(struct libusb_device_handle *handle,
+	int timeout_ms)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	struct loopback_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct loopback_transfer_priv *tpriv, *next;
+	struct list_head completed;
+	int disconnected;
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (list_empty(&hpriv->completed) && !dpriv->disconnected && timeout_ms) {
+		struct timeval tv;
+
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		usbi_cond_timedwait(&hpriv->cond, &cpriv->lock, &tv);
+	}
+	list_cut(&completed, &hpriv->completed);
+	disconnected = dpriv->disconnected;
+	usbi_mutex_unlock(&cpriv->lock);
+
+	/* as with the loopback thread, a transfer may be resubmitted from its
+	 * callback, so never look at one again after handling it */
+	list_for_each_entry_safe(tpriv, next, &completed, list, struct loopback_transfer_priv)
+		loopback_handle_transfer_completion(tpriv->itransfer);
+
+	return disconnected ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_SUCCESS;
+}
+
+static void build_descriptors(struct loopback_device_priv *dpriv,
+	const struct libusb_loopback_device *desc)
+{
+	unsigned char *d = dpriv->device_desc;
+	unsigned char *c = dpriv->config_desc;
+	int i;
+
+	d[0] = LIBUSB_DT_DEVICE_SIZE;
+	d[1] = LIBUSB_DT_DEVICE;
+	d[2] = 0x00;			/* bcdUSB 2.00 */
+	d[3] = 0x02;
+	d[4] = 0;			/* bDeviceClass, defined per interface */
+	d[5] = 0;
+	d[6] = 0;
+	d[7] = 64;			/* bMaxPacketSize0 */
+	d[8] = desc->idVendor & 0xff;
+	d[9] = desc->idVendor >> 8;
+	d[10] = desc->idProduct & 0xff;
+	d[11] = desc->idProduct >> 8;
+	d[12] = 0x00;			/* bcdDevice 1.00 */
+	d[13] = 0x01;
+	d[14] = 0;			/* no string descriptors */
+	d[15] = 0;
+	d[16] = 0;
+	d[17] = 1;			/* bNumConfigurations */
+
+	dpriv->config_desc_len = LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE +
+		(dpriv->num_endpoints - 1) * LIBUSB_DT_ENDPOINT_SIZE;
+
+	c[0] = LIBUSB_DT_CONFIG_SIZE;
+	c[1] = LIBUSB_DT_CONFIG;
+	c[2] = dpriv->config_desc_len & 0xff;
+	c[3] = dpriv->config_desc_len >> 8;
+	c[4] = 1;			/* bNumInterfaces */
+	c[5] = 1;			/* bConfigurationValue */
+	c[6] = 0;
+	c[7] = 0x80;			/* bus powered */
+	c[8] = 50;			/* 100mA */
+	c += LIBUSB_DT_CONFIG_SIZE;
+
+	c[0] = LIBUSB_DT_INTERFACE_SIZE;
+	c[1] = LIBUSB_DT_INTERFACE;
+	c[2] = 0;			/* bInterfaceNumber */
+	c[3] = 0;			/* bAlternateSetting */
+	c[4] = (uint8_t)(dpriv->num_endpoints - 1);
+	c[5] = LIBUSB_CLASS_VENDOR_SPEC;
+	c[6] = 0;
+	c[7] = 0;
+	c[8] = 0;
+	c += LIBUSB_DT_INTERFACE_SIZE;
+
+	for (i = 1; i < dpriv->num_endpoints; i++) {
+		const struct libusb_loopback_endpoint *ep = &dpriv->endpoints[i].desc;
+		uint8_t type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+
+		c[0] = LIBUSB_DT_ENDPOINT_SIZE;
+		c[1] = LIBUSB_DT_ENDPOINT;
+		c[2] = ep->bEndpointAddress;
+		c[3] = ep->bmAttributes;
+		c[4] = ep->wMaxPacketSize & 0xff;
+		c[5] = ep->wMaxPacketSize >> 8;
+		c[6] = type == LIBUSB_TRANSFER_TYPE_BULK ? 0 : 1;	/* bInterval */
+		c += LIBUSB_DT_ENDPOINT_SIZE;
+	}
+}
+
+static int check_endpoints(const struct libusb_loopback_device *desc)
+{
+	int i, j;
+
+	if (desc->num_endpoints < 0 || desc->num_endpoints >= LOOPBACK_MAX_ENDPOINTS ||
+	    (desc->num_endpoints && !desc->endpoints))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < desc->num_endpoints; i++) {
+		const struct libusb_loopback_endpoint *ep = &desc->endpoints[i];
+
+		if (!(ep->bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK) ||
+		    (ep->bEndpointAddress & ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK)) ||
+		    (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_CONTROL)
+			return LIBUSB_ERROR_INVALID_PARAM;
+
+		for (j = 0; j < i; j++) {
+			if (desc->endpoints[j].bEndpointAddress == ep->bEndpointAddress)
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_loopback
+ * Add a virtual device to a context of the loopback backend. The device is
+ * connected right away, so it shows up in device lists and the hotplug
+ * callbacks registered for it are called.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param ctx the context to add the device to, or NULL for the default
+ * context
+ * \param desc description of the device. The endpoints are copied, so the
+ * description does not need to outlive this call
+ * \param dev optional output location for the new device. If given, a
+ * reference is added to the device which must be released with
+ * libusb_unref_device()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the description is invalid
+ * \returns LIBUSB_ERROR_OVERFLOW if the context ran out of device addresses
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the context does not use the loopback
+ * backend
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_loopback_add_device(libusb_context *ctx,
+	const struct libusb_loopback_device *desc, libusb_device **dev)
+{
+	struct loopback_context_priv *cpriv;
+	struct loopback_device_priv *dpriv;
+	struct libusb_device *new_dev;
+	uint8_t address;
+	int i, r;
+
+	if (usbi_active_backend != &usbi_loopback_backend)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (!desc)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = check_endpoints(desc);
+	if (r)
+		return r;
+
+	ctx = usbi_get_context(ctx);
+	cpriv = usbi_get_context_priv(ctx);
+
+	usbi_mutex_lock(&cpriv->lock);
+	address = cpriv->next_address;
+	if (address <= LOOPBACK_MAX_ADDRESS)
+		cpriv->next_address++;
+	usbi_mutex_unlock(&cpriv->lock);
+	if (address > LOOPBACK_MAX_ADDRESS)
+		return LIBUSB_ERROR_OVERFLOW;
+
+	usbi_dbg("adding device %04x:%04x at address %u", desc->idVendor,
+		 desc->idProduct, address);
+
+	new_dev = usbi_alloc_device(ctx, LOOPBACK_BUS_NUMBER << 8 | address);
+	if (!new_dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	new_dev->bus_number = LOOPBACK_BUS_NUMBER;
+	new_dev->port_number = address;
+	new_dev->device_address = address;
+	new_dev->speed = LIBUSB_SPEED_HIGH;
+
+	dpriv = usbi_get_device_priv(new_dev);
+	dpriv->num_endpoints = desc->num_endpoints + 1;
+	dpriv->endpoints[0].desc.bmAttributes = LIBUSB_TRANSFER_TYPE_CONTROL;
+	dpriv->endpoints[0].desc.wMaxPacketSize = 64;
+	dpriv->endpoints[0].desc.latency_us = desc->control_latency_us;
+	for (i = 0; i < desc->num_endpoints; i++)
+		dpriv->endpoints[i + 1].desc = desc->endpoints[i];
+	build_descriptors(dpriv, desc);
+
+	memcpy(&new_dev->device_descriptor, dpriv->device_desc, LIBUSB_DT_DEVICE_SIZE);
+	usbi_localize_device_descriptor(&new_dev->device_descriptor);
+
+	r = usbi_sanitize_device(new_dev);
+	if (r < 0) {
+		libusb_unref_device(new_dev);
+		return r;
+	}
+
+	if (dev)
+		*dev = libusb_ref_device(new_dev);
+	usbi_connect_device(new_dev);
+
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_loopback
+ * Make the next transfers on an endpoint of a virtual device fail. The
+ * transfers are accepted as usual and complete with the given status after
+ * the latency of the endpoint, without transferring any data.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev a device added with libusb_loopback_add_device()
+ * \param endpoint the address of the endpoint, or 0 for the default control
+ * endpoint
+ * \param status the status to complete the transfers with, one of
+ * LIBUSB_TRANSFER_ERROR, LIBUSB_TRANSFER_TIMED_OUT, LIBUSB_TRANSFER_STALL and
+ * LIBUSB_TRANSFER_OVERFLOW
+ * \param count the number of transfers to fail, 0 to stop failing transfers
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if status or count is invalid
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device has no such endpoint
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the device does not belong to the
+ * loopback backend
+ */
+int API_EXPORTED libusb_loopback_inject_error(libusb_device *dev,
+	unsigned char endpoint, enum libusb_transfer_status status, int count)
+{
+	struct loopback_context_priv *cpriv;
+	struct loopback_endpoint *ep;
+
+	if (usbi_active_backend != &usbi_loopback_backend)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	switch (status) {
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if (count < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	cpriv = usbi_get_context_priv(DEVICE_CTX(dev));
+	usbi_mutex_lock(&cpriv->lock);
+	ep = find_endpoint(usbi_get_device_priv(dev), endpoint);
+	if (ep) {
+		ep->inject_status = status;
+		ep->inject_count = count;
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return ep ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+/** \ingroup libusb_loopback
+ * Disconnect a virtual device as if it had been unplugged. Transfers still
+ * pending on the device complete with LIBUSB_TRANSFER_NO_DEVICE, further
+ * submissions fail with LIBUSB_ERROR_NO_DEVICE and the hotplug callbacks
+ * registered for the device are called.
+ *
+ * The context drops its reference to the device when handling the hotplug
+ * event, so the caller must hold a reference of its own to keep using it.
+ *
+ * Since version 1.0.25, \ref LIBUSB_API_VERSION >= 0x01000109
+ *
+ * \param dev a device added with libusb_loopback_add_device()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device is already disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the device does not belong to the
+ * loopback backend
+ */
+int API_EXPORTED libusb_loopback_disconnect(libusb_device *dev)
+{
+	struct loopback_context_priv *cpriv;
+	struct loopback_device_priv *dpriv;
+	struct loopback_transfer_priv *tpriv, *next;
+	struct list_head gone;
+
+	if (usbi_active_backend != &usbi_loopback_backend)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	cpriv = usbi_get_context_priv(DEVICE_CTX(dev));
+	dpriv = usbi_get_device_priv(dev);
+
+	list_init(&gone);
+	usbi_mutex_lock(&cpriv->lock);
+	if (dpriv->disconnected) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	dpriv->disconnected = 1;
+
+	list_for_each_entry_safe(tpriv, next, &cpriv->pending, list, struct loopback_transfer_priv) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(tpriv->itransfer);
+
+		if (transfer->dev_handle->dev != dev)
+			continue;
+		list_del(&tpriv->list);
+		tpriv->pending = 0;
+		tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+		if (!queue_dedicated_completion(tpriv))
+			list_add_tail(&tpriv->list, &gone);
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	usbi_dbg("disconnecting device at address %u", dev->device_address);
+
+	list_for_each_entry_safe(tpriv, next, &gone, list, struct loopback_transfer_priv)
+		usbi_signal_transfer_completion(tpriv->itransfer);
+
+	/* the reference of the context is dropped once the hotplug event has
+	 * been handled */
+	usbi_disconnect_device(dev);
+
+	return LIBUSB_SUCCESS;
+}
+
+const struct usbi_os_backend usbi_loopback_backend = {
+	.name = "Loopback",
+	.caps = 0,
+	.init = loopback_init,
+	.exit = loopback_exit,
+	.get_active_config_descriptor = loopback_get_active_config_descriptor,
+	.get_config_descriptor = loopback_get_config_descriptor,
+
+	.open = loopback_open,
+	.close = loopback_close,
+	.get_configuration = loopback_get_configuration,
+	.set_configuration = loopback_set_configuration,
+	.claim_interface = loopback_claim_interface,
+	.release_interface = loopback_release_interface,
+
+	.set_interface_altsetting = loopback_set_interface_altsetting,
+	.clear_halt = loopback_clear_halt,
+	.reset_device = loopback_reset_device,
+
+	.submit_transfer = loopback_submit_transfer,
+	.cancel_transfer = loopback_cancel_transfer,
+
+	.set_dedicated_events = loopback_set_dedicated_events,
+	.handle_device_events = loopback_handle_device_events,
+
+	.handle_transfer_completion = loopback_handle_transfer_completion,
+
+	.context_priv_size = sizeof(struct loopback_context_priv),
+	.device_priv_size = sizeof(struct loopback_device_priv),
+	.device_handle_priv_size = sizeof(struct loopback_device_handle_priv),
+	.transfer_priv_size = sizeof(struct loopback_transfer_priv),
+};
@@ -93,6 +93,40 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	PTHREAD_CHECK(pthread_key_delete(key));
 }
 
+typedef void *usbi_atomic_ptr_t;
+static inline void *usbi_atomic_ptr_load(usbi_atomic_ptr_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+static inline void *usbi_atomic_ptr_exchange(usbi_atomic_ptr_t *ptr, void *val)
+{
+	return __atomic_exchange_n(ptr, val, __ATOMIC_ACQ_REL);
+}
+static inline int usbi_atomic_ptr_compare_exchange(usbi_atomic_ptr_t *ptr,
+	void **expected, void *desired)
+{
+	return __atomic_compare_exchange_n(ptr, expected, desired, 1,
+		__ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+}
+
+typedef long usbi_atomic_t;
+static inline long usbi_atomic_inc(usbi_atomic_t *a)
+{
+	return __atomic_add_fetch(a, 1, __ATOMIC_RELAXED);
+}
+static inline long usbi_atomic_dec(usbi_atomic_t *a)
+{
+	return __atomic_sub_fetch(a, 1, __ATOMIC_ACQ_REL);
+}
+static inline long usbi_atomic_load(usbi_atomic_t *a)
+{
+	return __atomic_load_n(a, __ATOMIC_RELAXED);
+}
+static inline void usbi_atomic_store(usbi_atomic_t *a, long val)
+{
+	__atomic_store_n(a, val, __ATOMIC_RELAXED);
+}
+
 unsigned int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -105,6 +105,44 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	WINAPI_CHECK(TlsFree(key));
 }
 
+typedef PVOID volatile usbi_atomic_ptr_t;
+static inline void *usbi_atomic_ptr_load(usbi_atomic_ptr_t *ptr)
+{
+	return InterlockedCompareExchangePointer(ptr, NULL, NULL);
+}
+static inline void *usbi_atomic_ptr_exchange(usbi_atomic_ptr_t *ptr, void *val)
+{
+	return InterlockedExchangePointer(ptr, val);
+}
+static inline int usbi_atomic_ptr_compare_exchange(usbi_atomic_ptr_t *ptr,
+	void **expected, void *desired)
+{
+	void *prev = InterlockedCompareExchangePointer(ptr, desired, *expected);
+
+	if (prev == *expected)
+		return 1;
+	*expected = prev;
+	return 0;
+}
+
+typedef LONG volatile usbi_atomic_t;
+static inline long usbi_atomic_inc(usbi_atomic_t *a)
+{
+	return InterlockedIncrement(a);
+}
+static inline long usbi_atomic_dec(usbi_atomic_t *a)
+{
+	return InterlockedDecrement(a);
+}
+static inline long usbi_atomic_load(usbi_atomic_t *a)
+{
+	return *a;
+}
+static inline void usbi_atomic_store(usbi_atomic_t *a, long val)
+{
+	InterlockedExchange(a, val);
+}
+
 static inline unsigned int usbi_get_tid(void)
 {
 	return (unsigned int)GetCurrentThreadId();
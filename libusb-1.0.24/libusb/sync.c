@@ -40,13 +40,38 @@ static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 	/* caller interprets result and frees transfer */
 }
 
+/* the context's event handling does not look at a handle whose events are
+ * handled separately, see libusb_set_dedicated_event_handling(). handle them
+ * here, or wait for the thread that does to report a completion. */
+static int sync_transfer_wait_dedicated(struct libusb_device_handle *dev_handle,
+	int *completed)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct timeval tv = { 60, 0 };
+	int r;
+
+	r = libusb_handle_device_events_timeout(dev_handle, &tv);
+	if (r != LIBUSB_ERROR_BUSY)
+		return r;
+
+	libusb_lock_event_waiters(ctx);
+	if (!*completed)
+		libusb_wait_for_event(ctx, &tv);
+	libusb_unlock_event_waiters(ctx);
+	return 0;
+}
+
 static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
 	int r, *completed = transfer->user_data;
-	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
 
 	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+		if (dev_handle->dedicated_events)
+			r = sync_transfer_wait_dedicated(dev_handle, completed);
+		else
+			r = libusb_handle_events_completed(ctx, completed);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -0,0 +1,576 @@
+/*
+ * libusb microbenchmarks for the transfer submission and completion paths
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The benchmarks run against virtual devices of the loopback backend, so
+ * they need no hardware and measure libusb itself rather than a USB stack.
+ * Every measurement is reported as a single line of the form
+ *
+ *   RESULT bench=<name> threads=<n> in_flight=<n> ops=<n> seconds=<s>
+ *          ops_per_sec=<n> p50_ns=<n> p90_ns=<n> p99_ns=<n> max_ns=<n>
+ *
+ * where the percentiles are taken over the time from submitting (or, for
+ * the cancel benchmarks, cancelling) each transfer until its callback ran.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define BENCH_VID		0x1d6b
+#define BENCH_PID		0x0104
+#define BENCH_EP_FAST		0x81	/* completes as soon as it is reaped */
+#define BENCH_EP_SLOW		0x82	/* keeps transfers in flight for 10 s */
+#define BENCH_TRANSFER_LENGTH	512
+#define BENCH_MAX_THREADS	4
+
+static const struct libusb_loopback_endpoint bench_endpoints[] = {
+	{ BENCH_EP_FAST, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0 },
+	{ BENCH_EP_SLOW, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 10000000 },
+};
+
+static const struct libusb_loopback_device bench_device = {
+	BENCH_VID, BENCH_PID, 0,
+	(int)(sizeof(bench_endpoints) / sizeof(bench_endpoints[0])),
+	bench_endpoints
+};
+
+static const int thread_counts[] = { 1, 2, 4 };
+
+/** Description of what each thread of a benchmark does. */
+struct workload {
+	const char *name;
+	unsigned char endpoint;
+	unsigned int timeout;
+	enum libusb_transfer_status expect;
+	/** Number of transfers each thread keeps in flight. */
+	int depth;
+	/** Number of completions each thread waits for. */
+	int count;
+};
+
+struct worker;
+
+struct bench_slot {
+	struct worker *worker;
+	uint64_t start_ns;
+};
+
+struct worker {
+	const struct workload *wl;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	pthread_t thread;
+	struct libusb_transfer **transfers;
+	struct bench_slot *slots;
+	unsigned char *buffers;
+	uint64_t *latencies;
+	int num_latencies;
+	int submitted;
+	int in_flight;
+	int done;
+	int failed;
+};
+
+struct bench_env {
+	libusb_context *ctx;
+	libusb_device *devs[BENCH_MAX_THREADS];
+	libusb_device_handle *handles[BENCH_MAX_THREADS];
+	int num_devices;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, int num_threads, int in_flight,
+	uint64_t elapsed_ns, uint64_t *latencies, size_t count)
+{
+	double seconds = (double)elapsed_ns / 1e9;
+
+	qsort(latencies, count, sizeof(*latencies), cmp_u64);
+	libusb_testlib_logf("RESULT bench=%s threads=%d in_flight=%d ops=%lu "
+		"seconds=%.6f ops_per_sec=%.0f p50_ns=%lu p90_ns=%lu p99_ns=%lu max_ns=%lu",
+		name, num_threads, in_flight, (unsigned long)count, seconds,
+		seconds > 0 ? (double)count / seconds : 0.0,
+		(unsigned long)latencies[count / 2],
+		(unsigned long)latencies[count * 9 / 10],
+		(unsigned long)latencies[count * 99 / 100],
+		(unsigned long)latencies[count - 1]);
+}
+
+static void bench_close(struct bench_env *env)
+{
+	for (int i = 0; i < env->num_devices; i++) {
+		libusb_close(env->handles[i]);
+		libusb_unref_device(env->devs[i]);
+	}
+	libusb_exit(env->ctx);
+}
+
+/** Creates a context with one opened virtual device per thread. */
+static libusb_testlib_result bench_open(struct bench_env *env, int num_devices)
+{
+	int r;
+
+	memset(env, 0, sizeof(*env));
+	r = libusb_init(&env->ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (int i = 0; i < num_devices; i++) {
+		r = libusb_loopback_add_device(env->ctx, &bench_device, &env->devs[i]);
+		if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+			libusb_testlib_logf("Loopback backend not available");
+			bench_close(env);
+			return TEST_STATUS_SKIP;
+		} else if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to add device: %d", r);
+			bench_close(env);
+			return TEST_STATUS_FAILURE;
+		}
+
+		r = libusb_open(env->devs[i], &env->handles[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to open device: %d", r);
+			libusb_unref_device(env->devs[i]);
+			bench_close(env);
+			return TEST_STATUS_FAILURE;
+		}
+		env->num_devices++;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void LIBUSB_CALL bench_cb(struct libusb_transfer *transfer)
+{
+	struct bench_slot *slot = transfer->user_data;
+	struct worker *w = slot->worker;
+
+	w->latencies[w->num_latencies++] = now_ns() - slot->start_ns;
+	if (transfer->status != w->wl->expect)
+		w->failed = 1;
+
+	if (!w->failed && w->submitted < w->wl->count) {
+		slot->start_ns = now_ns();
+		if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+			w->submitted++;
+			return;
+		}
+		w->failed = 1;
+	}
+
+	if (--w->in_flight == 0)
+		w->done = 1;
+}
+
+static void worker_free(struct worker *w)
+{
+	if (w->transfers) {
+		for (int i = 0; i < w->wl->depth; i++)
+			libusb_free_transfer(w->transfers[i]);
+	}
+	free(w->transfers);
+	free(w->slots);
+	free(w->buffers);
+	free(w->latencies);
+}
+
+static int worker_init(struct worker *w, const struct workload *wl,
+	libusb_context *ctx, libusb_device_handle *handle)
+{
+	memset(w, 0, sizeof(*w));
+	w->wl = wl;
+	w->ctx = ctx;
+	w->handle = handle;
+	w->transfers = calloc((size_t)wl->depth, sizeof(*w->transfers));
+	w->slots = calloc((size_t)wl->depth, sizeof(*w->slots));
+	w->buffers = malloc((size_t)wl->depth * BENCH_TRANSFER_LENGTH);
+	w->latencies = calloc((size_t)wl->count, sizeof(*w->latencies));
+	if (!w->transfers || !w->slots || !w->buffers || !w->latencies)
+		return -1;
+
+	for (int i = 0; i < wl->depth; i++) {
+		w->transfers[i] = libusb_alloc_transfer(0);
+		if (!w->transfers[i])
+			return -1;
+		w->slots[i].worker = w;
+		libusb_fill_bulk_transfer(w->transfers[i], handle, wl->endpoint,
+			w->buffers + i * BENCH_TRANSFER_LENGTH, BENCH_TRANSFER_LENGTH,
+			bench_cb, &w->slots[i], wl->timeout);
+	}
+
+	return 0;
+}
+
+/* Submits the initial transfers of a worker. This happens before any thread
+ * handles events, so no callback can run concurrently. */
+static int worker_prime(struct worker *w)
+{
+	uint64_t start = now_ns();
+	int r;
+
+	for (int i = 0; i < w->wl->depth; i++)
+		w->slots[i].start_ns = start;
+
+	r = libusb_submit_transfers(w->transfers, w->wl->depth);
+	if (r != w->wl->depth) {
+		libusb_testlib_logf("Failed to submit transfers: %d", r);
+		return -1;
+	}
+	w->submitted = w->in_flight = w->wl->depth;
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!w->done) {
+		int r = libusb_handle_events_completed(w->ctx, &w->done);
+
+		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			w->failed = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** Runs a workload with one thread and one device per thread, all threads
+ * sharing a context and taking turns at handling its events. */
+static libusb_testlib_result run_workload(const struct workload *wl, int num_threads)
+{
+	libusb_testlib_result result;
+	struct bench_env env;
+	struct worker workers[BENCH_MAX_THREADS];
+	uint64_t *latencies, start, elapsed;
+	size_t count = 0;
+	int i;
+
+	result = bench_open(&env, num_threads);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < num_threads; i++) {
+		if (worker_init(&workers[i], wl, env.ctx, env.handles[i])) {
+			libusb_testlib_logf("Failed to allocate transfers");
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < num_threads; i++) {
+		if (worker_prime(&workers[i]))
+			break;
+	}
+	if (i < num_threads) {
+		/* still reap what the primed workers submitted */
+		result = TEST_STATUS_FAILURE;
+		num_threads = i;
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < num_threads; i++) {
+		if (workers[i].failed) {
+			libusb_testlib_logf("Unexpected transfer status in %s", wl->name);
+			result = TEST_STATUS_FAILURE;
+		}
+		count += (size_t)workers[i].num_latencies;
+	}
+
+	if (result == TEST_STATUS_SUCCESS) {
+		latencies = malloc(count * sizeof(*latencies));
+		if (!latencies) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+		count = 0;
+		for (i = 0; i < num_threads; i++) {
+			memcpy(latencies + count, workers[i].latencies,
+				(size_t)workers[i].num_latencies * sizeof(*latencies));
+			count += (size_t)workers[i].num_latencies;
+		}
+		report(wl->name, num_threads, wl->depth * num_threads, elapsed,
+			latencies, count);
+		free(latencies);
+	}
+
+out:
+	for (i = 0; i < BENCH_MAX_THREADS; i++) {
+		if (workers[i].wl)
+			worker_free(&workers[i]);
+	}
+	bench_close(&env);
+	return result;
+}
+
+/** Measures submit and reap throughput and latency with a queue of
+ * transfers that complete immediately. */
+static libusb_testlib_result test_submit_reap(void)
+{
+	static const struct workload wl = {
+		"submit_reap", BENCH_EP_FAST, 0, LIBUSB_TRANSFER_COMPLETED, 32, 50000
+	};
+
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+		libusb_testlib_result r = run_workload(&wl, thread_counts[i]);
+
+		if (r != TEST_STATUS_SUCCESS)
+			return r;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Measures how quickly transfers whose timeout expires are handled when
+ * many of them expire together. */
+static libusb_testlib_result test_timeouts(void)
+{
+	static const struct workload wl = {
+		"timeout", BENCH_EP_SLOW, 1, LIBUSB_TRANSFER_TIMED_OUT, 64, 3200
+	};
+
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+		libusb_testlib_result r = run_workload(&wl, thread_counts[i]);
+
+		if (r != TEST_STATUS_SUCCESS)
+			return r;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Cancels all transfers with N in flight, either one at a time or with a
+ * single libusb_cancel_transfers() call on their endpoint. */
+static libusb_testlib_result run_cancel(const char *name, int bulk)
+{
+	static const int in_flight[] = { 16, 256, 4096 };
+
+	for (size_t n = 0; n < sizeof(in_flight) / sizeof(in_flight[0]); n++) {
+		struct workload wl = {
+			name, BENCH_EP_SLOW, 0, LIBUSB_TRANSFER_CANCELLED,
+			in_flight[n], in_flight[n]
+		};
+		libusb_testlib_result result;
+		struct bench_env env;
+		struct worker w;
+		uint64_t start;
+
+		result = bench_open(&env, 1);
+		if (result != TEST_STATUS_SUCCESS)
+			return result;
+
+		if (worker_init(&w, &wl, env.ctx, env.handles[0])) {
+			libusb_testlib_logf("Failed to allocate transfers");
+			result = TEST_STATUS_ERROR;
+		} else if (worker_prime(&w)) {
+			result = TEST_STATUS_FAILURE;
+		} else {
+			start = now_ns();
+			if (bulk) {
+				for (int i = 0; i < wl.depth; i++)
+					w.slots[i].start_ns = start;
+				if (libusb_cancel_transfers(env.handles[0], BENCH_EP_SLOW) != wl.depth)
+					w.failed = 1;
+			} else {
+				for (int i = 0; i < wl.depth; i++) {
+					w.slots[i].start_ns = now_ns();
+					libusb_cancel_transfer(w.transfers[i]);
+				}
+			}
+			worker_main(&w);
+			if (w.failed) {
+				libusb_testlib_logf("Unexpected transfer status in %s", name);
+				result = TEST_STATUS_FAILURE;
+			} else {
+				report(wl.name, 1, wl.depth, now_ns() - start,
+					w.latencies, (size_t)w.num_latencies);
+			}
+		}
+
+		worker_free(&w);
+		bench_close(&env);
+		if (result != TEST_STATUS_SUCCESS)
+			return result;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Measures the cost of cancelling all transfers with N in flight. */
+static libusb_testlib_result test_cancel(void)
+{
+	return run_cancel("cancel", 0);
+}
+
+/** Measures the cost of cancelling all transfers of an endpoint with N in
+ * flight in one call. */
+static libusb_testlib_result test_cancel_endpoint(void)
+{
+	return run_cancel("cancel_endpoint", 1);
+}
+
+struct device_events_thread {
+	libusb_device_handle *handle;
+	pthread_t thread;
+	volatile int stop;
+	int failed;
+};
+
+static void *device_events_main(void *arg)
+{
+	struct device_events_thread *t = arg;
+	struct timeval tv = { 0, 10000 };
+
+	while (!t->stop) {
+		int r = libusb_handle_device_events_timeout(t->handle, &tv);
+
+		/* BUSY while a synchronous call handles the events itself */
+		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED &&
+		    r != LIBUSB_ERROR_BUSY) {
+			libusb_testlib_logf("Failed to handle device events: %d", r);
+			t->failed = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** Measures synchronous transfers on a handle with dedicated event
+ * handling, handling its events either in the calling thread or in a
+ * thread of their own. Also checks that their timeouts still fire. */
+static libusb_testlib_result test_sync_dedicated(void)
+{
+	enum { COUNT = 20000 };
+	unsigned char buffer[BENCH_TRANSFER_LENGTH];
+	uint64_t *latencies;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+
+	latencies = malloc(COUNT * sizeof(*latencies));
+	if (!latencies)
+		return TEST_STATUS_ERROR;
+
+	for (int threads = 1; threads <= 2 && result == TEST_STATUS_SUCCESS; threads++) {
+		struct device_events_thread t;
+		struct bench_env env;
+		uint64_t start;
+		int i, r, transferred;
+
+		result = bench_open(&env, 1);
+		if (result != TEST_STATUS_SUCCESS)
+			break;
+
+		memset(&t, 0, sizeof(t));
+		t.handle = env.handles[0];
+		r = libusb_set_dedicated_event_handling(t.handle, 1);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to enable dedicated event handling: %d", r);
+			bench_close(&env);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		if (threads == 2)
+			pthread_create(&t.thread, NULL, device_events_main, &t);
+
+		start = now_ns();
+		for (i = 0; i < COUNT; i++) {
+			uint64_t t0 = now_ns();
+
+			r = libusb_bulk_transfer(t.handle, BENCH_EP_FAST, buffer,
+				sizeof(buffer), &transferred, 1000);
+			if (r != LIBUSB_SUCCESS || transferred != (int)sizeof(buffer))
+				break;
+			latencies[i] = now_ns() - t0;
+		}
+		if (i < COUNT) {
+			libusb_testlib_logf("Synchronous transfer failed: %d", r);
+			result = TEST_STATUS_FAILURE;
+		} else {
+			report("sync_dedicated", threads, 1, now_ns() - start,
+				latencies, COUNT);
+		}
+
+		r = libusb_bulk_transfer(t.handle, BENCH_EP_SLOW, buffer,
+			sizeof(buffer), &transferred, 10);
+		if (r != LIBUSB_ERROR_TIMEOUT) {
+			libusb_testlib_logf("Synchronous transfer did not time out: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+
+		if (threads == 2) {
+			t.stop = 1;
+			pthread_join(t.thread, NULL);
+			if (t.failed)
+				result = TEST_STATUS_FAILURE;
+		}
+		bench_close(&env);
+	}
+
+	free(latencies);
+	return result;
+}
+
+/* Fill in the list of tests. */
+static const libusb_testlib_test tests[] = {
+	{ "submit_reap", &test_submit_reap },
+	{ "cancel", &test_cancel },
+	{ "cancel_endpoint", &test_cancel_endpoint },
+	{ "timeouts", &test_timeouts },
+	{ "sync_dedicated", &test_sync_dedicated },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	/* run against virtual devices rather than the system's */
+	setenv("LIBUSB_BACKEND", "loopback", 1);
+
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
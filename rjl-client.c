@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
+
 #include "SDL2-2.0.14/include/SDL.h"
 #include "SDL2-2.0.14/include/SDL_render.h"
+#include "SDL2-2.0.14/include/SDL_test_font.h"
 #include "libusb-1.0.24/libusb/libusb.h"
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+
 #define TYPE_JOY_CMD 1
 #define TYPE_JOY_DAT 2
 #define ASYNC_CMD_DEBUG 1
@@ -111,7 +122,18 @@ struct EventData
 
 static volatile sig_atomic_t g_thread_die;
 static volatile sig_atomic_t g_thread_failed;
-// TODO: static sthread_t *g_thread;
+static SDL_Thread *g_thread;
+
+/* Per-thread scheduling knobs, filled in from the command line. */
+struct thread_opts
+{
+   int cpu;      /* -1 leaves the affinity alone. */
+   int priority; /* SDL_ThreadPriority, -1 leaves it alone. */
+};
+
+static struct thread_opts usb_opts = { -1, -1 };
+static struct thread_opts render_opts = { -1, -1 };
+static bool lock_memory;
 
 static libusb_context *context;
 static libusb_device_handle *device;
@@ -139,10 +161,6 @@ static inline void write_le32(uint8_t *buf, uint32_t val)
 #define REMOTE_PID 0x01c9
 #define REMOTE_PID2 0x02d2
 
-static SDL_Renderer *renderer;
-static SDL_Texture *frames[4];
-static SDL_Window *window;
-
 static const uint32_t formats[] = {
     SDL_PIXELFORMAT_RGB565,
     SDL_PIXELFORMAT_ARGB1555,
@@ -209,20 +227,759 @@ static bool handle_hello(libusb_device_handle *dev)
    return true;
 }
 
-static void process_bulk(const uint8_t *block)
+/* Frames travel from bulk_thread() to the views through a pool of reference
+ * counted blocks. The USB thread fills frame_back and publishes it as
+ * frame_mailbox, where a newer frame replaces one nobody claimed. The render
+ * loop claims the mailbox as frame_front and shares it with the offscreen
+ * consumer; a block returns to the pool when its last reference goes away.
+ * Only pointers change hands, so a frame is never copied. */
+#define HOSTFS_MAX_BLOCK (1024 * 1024)
+#define MAX_VIEWS 4
+/* Every view and the offscreen consumer may use a format of its own. */
+#define MAX_CONVERSIONS (MAX_VIEWS + 1)
+
+struct frame_block
+{
+   SDL_atomic_t refcount;
+   double arrival; /* now_seconds() when the last byte came in. */
+   int32_t mode;   /* Pixel mode, -1 until decode_frame() accepts the block. */
+
+   /* Copies in the other pixel formats some view or consumer needs, each
+    * made once by decode_frame() before the block is shared. */
+   unsigned conversions;
+   struct
+   {
+      uint32_t format;
+      uint8_t *pixels;
+   } converted[MAX_CONVERSIONS];
+
+   uint8_t data[HOSTFS_MAX_BLOCK];
+};
+
+/* Back, mailbox and front, plus the pending and current frame of the
+ * offscreen consumer. */
+#define FRAME_BLOCKS 5
+
+static struct frame_block frame_blocks[FRAME_BLOCKS];
+static struct frame_block *free_blocks[FRAME_BLOCKS];
+static unsigned free_count;
+static struct frame_block *frame_back;
+static struct frame_block *frame_mailbox;
+static struct frame_block *frame_front;
+static SDL_mutex *frame_lock;
+static SDL_cond *frame_cond;
+
+/* Receive side counters for the HUD, protected by frame_lock. */
+static unsigned frames_received;
+static unsigned frames_overwritten;
+static uint64_t bytes_received;
+
+/* Frame pacing. The PSP stamps every frame with its vblank count, so arrival
+ * times can be fitted to a steady device clock, and frames are then submitted
+ * at a fixed phase of the display refresh instead of whenever USB jitter
+ * happens to deliver them. */
+struct pacer
+{
+   bool enabled;
+   bool drop_late;
+   double phase;         /* Fraction of a refresh to submit ahead of vblank. */
+   double budget;        /* Longest a frame may be held back, 0 = one refresh. */
+
+   double refresh;       /* Display refresh period. */
+   double vblank;        /* Host time of the last observed display vblank. */
+
+   double vcount_period; /* Smoothed host seconds per PSP vblank. */
+   double clock;         /* Fitted host time of last_ref. */
+   double last_arrival;
+   int32_t last_ref;
+   bool seeded;
+
+   unsigned dropped;
+};
+
+#define PSP_VCOUNT_PERIOD (1001.0 / 60000.0)
+
+static struct pacer pacer = {
+   .enabled = true,
+   .phase = 0.25,
+};
+
+static double now_seconds(void)
+{
+   return (double)SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+}
+
+static void pacer_init(struct pacer *p, SDL_Window *window)
+{
+   SDL_DisplayMode mode;
+
+   p->refresh = 1.0 / 60.0;
+   if (SDL_GetWindowDisplayMode(window, &mode) == 0 && mode.refresh_rate > 0)
+      p->refresh = 1.0 / mode.refresh_rate;
+
+   if (p->budget <= 0.0)
+      p->budget = p->refresh;
+
+   p->vcount_period = PSP_VCOUNT_PERIOD;
+   p->vblank = now_seconds();
+   p->seeded = false;
+}
+
+/* Returns the host time at which the frame should be handed to the renderer. */
+static double pacer_schedule(struct pacer *p, int32_t ref, double arrival)
+{
+   int32_t delta = (int32_t)((uint32_t)ref - (uint32_t)p->last_ref);
+
+   if (!p->seeded || delta <= 0 || arrival - p->last_arrival > 1.0)
+   {
+      /* First frame, device restart or a long stall: start the fit over. */
+      p->clock = arrival;
+      p->seeded = true;
+   }
+   else
+   {
+      double measured = (arrival - p->last_arrival) / delta;
+      double predicted;
+
+      /* Ignore single-frame jitter outliers when tracking clock drift. */
+      if (measured > PSP_VCOUNT_PERIOD * 0.9 && measured < PSP_VCOUNT_PERIOD * 1.1)
+         p->vcount_period += (measured - p->vcount_period) * 0.02;
+
+      /* USB only ever delays a frame, so snap to early arrivals right away
+       * and creep towards late ones. */
+      predicted = p->clock + delta * p->vcount_period;
+      if (arrival < predicted)
+         p->clock = arrival;
+      else
+         p->clock = predicted + (arrival - predicted) * 0.01;
+   }
+
+   p->last_ref = ref;
+   p->last_arrival = arrival;
+
+   if (!p->enabled)
+      return arrival;
+
+   double lead = p->phase * p->refresh;
+   double slots = SDL_ceil((p->clock + lead - p->vblank) / p->refresh);
+   double target = p->vblank + slots * p->refresh - lead;
+
+   if (target > arrival + p->budget)
+      target = arrival + p->budget;
+
+   return target;
+}
+
+static void pacer_presented(struct pacer *p)
+{
+   /* With vsync on, SDL_RenderPresent() returns right after a vblank. */
+   if (p->enabled)
+      p->vblank = now_seconds();
+}
+
+static void sleep_until(double deadline)
+{
+   double left = deadline - now_seconds();
+
+   if (left > 0.002)
+      SDL_Delay((uint32_t)((left - 0.001) * 1000.0));
+
+   while (now_seconds() < deadline)
+      ;
+}
+
+/* Call with frame_lock held. */
+static struct frame_block *frame_alloc_locked(void)
+{
+   struct frame_block *block;
+
+   if (!free_count)
+      return NULL;
+
+   block = free_blocks[--free_count];
+   SDL_AtomicSet(&block->refcount, 1);
+   block->mode = -1;
+   block->conversions = 0;
+   return block;
+}
+
+/* Call with frame_lock held. */
+static void frame_put_locked(struct frame_block *block)
+{
+   if (SDL_AtomicDecRef(&block->refcount))
+      free_blocks[free_count++] = block;
+}
+
+static void frame_get(struct frame_block *block)
+{
+   SDL_AtomicIncRef(&block->refcount);
+}
+
+static void frame_put(struct frame_block *block)
+{
+   if (!SDL_AtomicDecRef(&block->refcount))
+      return;
+
+   SDL_LockMutex(frame_lock);
+   free_blocks[free_count++] = block;
+   SDL_UnlockMutex(frame_lock);
+}
+
+static void frame_pool_init(void)
+{
+   for (unsigned i = 0; i < FRAME_BLOCKS; i++)
+      free_blocks[i] = &frame_blocks[i];
+   free_count = FRAME_BLOCKS;
+
+   frame_back = frame_alloc_locked();
+   frame_mailbox = NULL;
+   frame_front = NULL;
+}
+
+static void frame_pool_deinit(void)
+{
+   for (unsigned i = 0; i < FRAME_BLOCKS; i++)
+   {
+      for (unsigned c = 0; c < MAX_CONVERSIONS; c++)
+      {
+         free(frame_blocks[i].converted[c].pixels);
+         frame_blocks[i].converted[c].pixels = NULL;
+      }
+   }
+
+   frame_back = NULL;
+   frame_mailbox = NULL;
+   frame_front = NULL;
+   free_count = 0;
+}
+
+static void publish_frame(size_t size)
+{
+   struct frame_block *next;
+
+   frame_back->arrival = now_seconds();
+
+   SDL_LockMutex(frame_lock);
+   if (frame_mailbox)
+   {
+      frames_overwritten++;
+      frame_put_locked(frame_mailbox);
+      frame_mailbox = NULL;
+   }
+   frames_received++;
+   bytes_received += size;
+
+   /* The replaced mailbox block is always free again by now, this only
+    * guards against a consumer leaking references. */
+   next = frame_alloc_locked();
+   if (next)
+   {
+      frame_mailbox = frame_back;
+      frame_back = next;
+      SDL_CondSignal(frame_cond);
+   }
+   else
+      frames_overwritten++;
+   SDL_UnlockMutex(frame_lock);
+}
+
+static bool wait_frame(uint32_t timeout_ms)
+{
+   bool ready = false;
+
+   SDL_LockMutex(frame_lock);
+   if (!frame_mailbox)
+      SDL_CondWaitTimeout(frame_cond, frame_lock, timeout_ms);
+
+   if (frame_mailbox)
+   {
+      if (frame_front)
+         frame_put_locked(frame_front);
+      frame_front = frame_mailbox;
+      frame_mailbox = NULL;
+      ready = true;
+   }
+   SDL_UnlockMutex(frame_lock);
+
+   return ready;
+}
+
+/* Sleeps until deadline, returning early with true if a newer frame has been
+ * swapped into frame_front in the meantime. */
+static bool wait_frame_until(double deadline)
+{
+   for (;;)
+   {
+      double left = deadline - now_seconds();
+
+      if (left <= 0.002)
+         break;
+
+      if (wait_frame((uint32_t)((left - 0.001) * 1000.0)))
+         return true;
+   }
+
+   sleep_until(deadline);
+   return false;
+}
+
+static void apply_thread_opts(const struct thread_opts *opts, const char *name)
+{
+#ifdef __linux__
+   if (opts->cpu >= 0)
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(opts->cpu, &set);
+
+      /* pid 0 is the calling thread, not the whole process. */
+      if (sched_setaffinity(0, sizeof(set), &set) < 0)
+         printf("Failed to pin %s thread to CPU %d.\n", name, opts->cpu);
+   }
+#else
+   if (opts->cpu >= 0)
+      printf("CPU affinity is not supported here, ignoring it for %s thread.\n", name);
+#endif
+
+   if (opts->priority >= 0 && SDL_SetThreadPriority((SDL_ThreadPriority)opts->priority) < 0)
+      printf("Failed to set %s thread priority: %s\n", name, SDL_GetError());
+}
+
+/* Offscreen consumer: writes every frame as raw pixels of one format to a
+ * file or pipe from its own thread, so a slow reader never holds up the
+ * views. ARGB8888 is what e.g. "ffmpeg -f rawvideo -pixel_format bgra
+ * -video_size 480x272" expects on little endian hosts. */
+struct consumer
+{
+   const char *path;
+   FILE *file;
+   uint32_t format;
+   SDL_Thread *thread;
+   SDL_mutex *lock;
+   SDL_cond *cond;
+   struct frame_block *pending;
+   bool die;
+   unsigned dropped;
+};
+
+static struct consumer dump = {
+    .format = SDL_PIXELFORMAT_ARGB8888};
+
+/* On-screen statistics, toggled with F1. The font is rasterised once into an
+ * atlas and the text is only recomposed when the numbers change, so showing
+ * the HUD costs one extra SDL_RenderCopy per frame. */
+#define HUD_COLUMNS 30
+#define HUD_ROWS 3
+#define HUD_ATLAS_COLUMNS 16
+#define HUD_LATENCY_SAMPLES 256
+#define HUD_INTERVAL 0.5
+
+struct hud
+{
+   bool visible;
+   bool dirty;
+   SDL_Renderer *renderer;
+   SDL_Texture *atlas;
+   SDL_Texture *text;
+
+   double last_update;
+   unsigned last_received;
+   unsigned last_presented;
+   uint64_t last_bytes;
+
+   unsigned presented;
+   int32_t mode;
+   float latency[HUD_LATENCY_SAMPLES];
+   unsigned latency_count;
+};
+
+static struct hud hud;
+
+static const char *const mode_names[] = {
+    "RGB565",
+    "ARGB1555",
+    "ARGB4444",
+    "ARGB8888"};
+
+static bool hud_build_atlas(void)
+{
+   if (SDL_SetRenderTarget(hud.renderer, hud.atlas) < 0)
+      return false;
+
+   SDL_SetRenderDrawBlendMode(hud.renderer, SDL_BLENDMODE_NONE);
+   SDL_SetRenderDrawColor(hud.renderer, 0, 0, 0, 0);
+   SDL_RenderClear(hud.renderer);
+   SDL_SetRenderDrawColor(hud.renderer, 255, 255, 255, 255);
+
+   for (int c = ' '; c < 128; c++)
+   {
+      int i = c - ' ';
+      SDLTest_DrawCharacter(hud.renderer,
+                            (i % HUD_ATLAS_COLUMNS) * FONT_CHARACTER_SIZE,
+                            (i / HUD_ATLAS_COLUMNS) * FONT_CHARACTER_SIZE,
+                            (char)c);
+   }
+
+   SDLTest_CleanupTextDrawing();
+   SDL_SetRenderTarget(hud.renderer, NULL);
+   hud.dirty = true;
+   return true;
+}
+
+static bool hud_init(SDL_Renderer *renderer)
+{
+   hud.renderer = renderer;
+
+   if (!SDL_RenderTargetSupported(renderer))
+   {
+      puts("Render targets unsupported, HUD disabled.");
+      return false;
+   }
+
+   hud.atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                 HUD_ATLAS_COLUMNS * FONT_CHARACTER_SIZE,
+                                 (128 - ' ') / HUD_ATLAS_COLUMNS * FONT_CHARACTER_SIZE);
+   hud.text = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                HUD_COLUMNS * FONT_CHARACTER_SIZE,
+                                HUD_ROWS * FONT_CHARACTER_SIZE);
+
+   if (!hud.atlas || !hud.text || !hud_build_atlas())
+   {
+      puts(SDL_GetError());
+      return false;
+   }
+
+   SDL_SetTextureBlendMode(hud.atlas, SDL_BLENDMODE_BLEND);
+   SDL_SetTextureBlendMode(hud.text, SDL_BLENDMODE_BLEND);
+   hud.last_update = now_seconds();
+   return true;
+}
+
+static void hud_deinit(void)
+{
+   if (hud.text)
+      SDL_DestroyTexture(hud.text);
+   if (hud.atlas)
+      SDL_DestroyTexture(hud.atlas);
+   hud.text = NULL;
+   hud.atlas = NULL;
+   hud.renderer = NULL;
+}
+
+static void hud_record_present(double arrival)
+{
+   hud.presented++;
+   hud.latency[hud.latency_count++ % HUD_LATENCY_SAMPLES] = (float)(now_seconds() - arrival);
+}
+
+static int compare_float(const void *a, const void *b)
+{
+   float x = *(const float *)a;
+   float y = *(const float *)b;
+   return (x > y) - (x < y);
+}
+
+static void hud_compose(char lines[HUD_ROWS][HUD_COLUMNS + 1])
+{
+   SDL_SetRenderTarget(hud.renderer, hud.text);
+   SDL_SetRenderDrawBlendMode(hud.renderer, SDL_BLENDMODE_NONE);
+   SDL_SetRenderDrawColor(hud.renderer, 0, 0, 0, 160);
+   SDL_RenderClear(hud.renderer);
+
+   for (int row = 0; row < HUD_ROWS; row++)
+   {
+      for (int col = 0; lines[row][col]; col++)
+      {
+         int i = (unsigned char)lines[row][col] - ' ';
+         if (i <= 0 || i >= 128 - ' ')
+            continue;
+
+         SDL_Rect src = {
+             (i % HUD_ATLAS_COLUMNS) * FONT_CHARACTER_SIZE,
+             (i / HUD_ATLAS_COLUMNS) * FONT_CHARACTER_SIZE,
+             FONT_CHARACTER_SIZE,
+             FONT_CHARACTER_SIZE};
+         SDL_Rect dst = {
+             col * FONT_CHARACTER_SIZE,
+             row * FONT_CHARACTER_SIZE,
+             FONT_CHARACTER_SIZE,
+             FONT_CHARACTER_SIZE};
+         SDL_RenderCopy(hud.renderer, hud.atlas, &src, &dst);
+      }
+   }
+
+   SDL_SetRenderTarget(hud.renderer, NULL);
+}
+
+static void hud_update(double now)
+{
+   double elapsed = now - hud.last_update;
+   unsigned received, overwritten;
+   uint64_t bytes;
+   float sorted[HUD_LATENCY_SAMPLES];
+   unsigned samples = hud.latency_count < HUD_LATENCY_SAMPLES ? hud.latency_count : HUD_LATENCY_SAMPLES;
+   float p99 = 0.0f;
+   char lines[HUD_ROWS][HUD_COLUMNS + 1];
+
+   SDL_LockMutex(frame_lock);
+   received = frames_received;
+   overwritten = frames_overwritten;
+   bytes = bytes_received;
+   SDL_UnlockMutex(frame_lock);
+
+   if (samples)
+   {
+      memcpy(sorted, hud.latency, samples * sizeof(*sorted));
+      qsort(sorted, samples, sizeof(*sorted), compare_float);
+      p99 = sorted[(samples * 99) / 100];
+   }
+
+   snprintf(lines[0], sizeof(lines[0]), "RX %5.1f fps %6.2f MB/s",
+            (received - hud.last_received) / elapsed,
+            (bytes - hud.last_bytes) / elapsed / (1024.0 * 1024.0));
+   if (dump.thread)
+      snprintf(lines[1], sizeof(lines[1]), "TX %5.1f fps drop %u dump %u",
+               (hud.presented - hud.last_presented) / elapsed,
+               overwritten + pacer.dropped, dump.dropped);
+   else
+      snprintf(lines[1], sizeof(lines[1]), "TX %5.1f fps drop %u",
+               (hud.presented - hud.last_presented) / elapsed,
+               overwritten + pacer.dropped);
+   snprintf(lines[2], sizeof(lines[2]), "%-8s p99 %5.1f ms",
+            hud.mode >= 0 && hud.mode < 4 ? mode_names[hud.mode] : "?",
+            p99 * 1000.0f);
+
+   hud_compose(lines);
+
+   hud.last_update = now;
+   hud.last_received = received;
+   hud.last_presented = hud.presented;
+   hud.last_bytes = bytes;
+   hud.dirty = false;
+}
+
+/* Recomposing switches render targets, so do it before drawing the frame. */
+static void hud_prepare(void)
+{
+   double now;
+
+   if (!hud.visible || !hud.text)
+      return;
+
+   now = now_seconds();
+   if (hud.dirty || now - hud.last_update >= HUD_INTERVAL)
+      hud_update(now);
+}
+
+static void hud_draw(void)
+{
+   if (!hud.visible || !hud.text)
+      return;
+
+   SDL_Rect dst = {
+       4,
+       4,
+       HUD_COLUMNS * FONT_CHARACTER_SIZE,
+       HUD_ROWS * FONT_CHARACTER_SIZE};
+   SDL_RenderCopy(hud.renderer, hud.text, NULL, &dst);
+}
+
+/* Streaming textures are created on first use of a pixel mode, two per mode
+ * so the upload of frame N+1 never waits on the texture frame N is still
+ * being drawn from. A mode unused for TEXTURE_IDLE_SECONDS gives them back. */
+#define TEXTURE_IDLE_SECONDS 5.0
+
+struct texture_slot
+{
+   SDL_Texture *textures[2];
+   unsigned next;
+   double last_used;
+};
+
+/* A window showing the stream. views[0] is the main window: it alone carries
+ * the HUD and presents with vsync, so it is the one the pacer follows. Other
+ * views show the same frames at their own scale. */
+struct view
+{
+   SDL_Window *window;
+   SDL_Renderer *renderer;
+   int scale;
+   uint32_t formats[4]; /* Texture format used for each pixel mode. */
+   struct texture_slot slots[4];
+};
+
+static struct view views[MAX_VIEWS] = {
+    {.scale = 1}};
+static unsigned view_count = 1;
+
+static SDL_Texture *acquire_texture(struct view *view, int32_t mode, double now)
+{
+   struct texture_slot *slot = &view->slots[mode];
+   SDL_Texture **texture = &slot->textures[slot->next];
+
+   if (!*texture)
+   {
+      *texture = SDL_CreateTexture(
+          view->renderer,
+          view->formats[mode],
+          SDL_TEXTUREACCESS_STREAMING,
+          PSP_WIDTH,
+          PSP_HEIGHT);
+
+      if (!*texture)
+      {
+         puts(SDL_GetError());
+         return NULL;
+      }
+   }
+
+   slot->next ^= 1;
+   slot->last_used = now;
+   return *texture;
+}
+
+static void destroy_texture_slot(struct texture_slot *slot)
+{
+   for (unsigned i = 0; i < 2; i++)
+   {
+      if (slot->textures[i])
+         SDL_DestroyTexture(slot->textures[i]);
+      slot->textures[i] = NULL;
+   }
+   slot->next = 0;
+}
+
+static void release_idle_textures(double now)
+{
+   for (unsigned v = 0; v < view_count; v++)
+   {
+      for (int32_t mode = 0; mode < 4; mode++)
+      {
+         struct texture_slot *slot = &views[v].slots[mode];
+
+         if (slot->textures[0] && now - slot->last_used > TEXTURE_IDLE_SECONDS)
+            destroy_texture_slot(slot);
+      }
+   }
+}
+
+static bool view_open(struct view *view, bool primary)
+{
+   SDL_RendererInfo info;
+   char title[32];
+
+   if (primary)
+      snprintf(title, sizeof(title), "RJL-Client");
+   else
+      snprintf(title, sizeof(title), "RJL-Client (%dx)", view->scale);
+
+   view->window = SDL_CreateWindow(
+       title,
+       SDL_WINDOWPOS_UNDEFINED,
+       SDL_WINDOWPOS_UNDEFINED,
+       PSP_WIDTH * view->scale,
+       PSP_HEIGHT * view->scale,
+       primary ? SDL_WINDOW_BORDERLESS : 0);
+
+   if (view->window == NULL)
+   {
+      puts(SDL_GetError());
+      return false;
+   }
+
+   view->renderer = SDL_CreateRenderer(view->window, -1, SDL_RENDERER_ACCELERATED |
+                                       (primary && pacer.enabled ? SDL_RENDERER_PRESENTVSYNC : 0));
+
+   /* Not every driver can sync to vblank, pace against the estimate then. */
+   if (view->renderer == NULL && primary && pacer.enabled)
+      view->renderer = SDL_CreateRenderer(view->window, -1, SDL_RENDERER_ACCELERATED);
+
+   if (view->renderer == NULL || SDL_GetRendererInfo(view->renderer, &info) < 0)
+   {
+      puts(SDL_GetError());
+      return false;
+   }
+
+   /* Upload the PSP format as is where the renderer takes it, otherwise let
+    * decode_frame() convert once for every view sharing the fallback. */
+   for (int32_t mode = 0; mode < 4; mode++)
+   {
+      view->formats[mode] = info.num_texture_formats ? info.texture_formats[0] : formats[mode];
+
+      for (Uint32 i = 0; i < info.num_texture_formats; i++)
+         if (info.texture_formats[i] == formats[mode])
+            view->formats[mode] = formats[mode];
+   }
+
+   return true;
+}
+
+static void view_close(struct view *view)
+{
+   for (int32_t mode = 0; mode < 4; mode++)
+      destroy_texture_slot(&view->slots[mode]);
+
+   if (view->renderer)
+      SDL_DestroyRenderer(view->renderer);
+   if (view->window)
+      SDL_DestroyWindow(view->window);
+   view->renderer = NULL;
+   view->window = NULL;
+}
+
+static const uint8_t *frame_pixels(const struct frame_block *block, uint32_t format)
+{
+   if (format == formats[block->mode])
+      return block->data + sizeof(struct JoyScrHeader);
+
+   for (unsigned i = 0; i < block->conversions; i++)
+      if (block->converted[i].format == format)
+         return block->converted[i].pixels;
+
+   return NULL;
+}
+
+static bool convert_frame(struct frame_block *block, uint32_t format)
+{
+   uint32_t native = formats[block->mode];
+
+   if (frame_pixels(block, format))
+      return true;
+
+   if (block->conversions == MAX_CONVERSIONS)
+      return false;
+
+   uint8_t **pixels = &block->converted[block->conversions].pixels;
+
+   if (!*pixels && !(*pixels = malloc(PSP_WIDTH * PSP_HEIGHT * 4)))
+      return false;
+
+   if (SDL_ConvertPixels(PSP_WIDTH, PSP_HEIGHT,
+                         native, block->data + sizeof(struct JoyScrHeader),
+                         PSP_WIDTH * SDL_BYTESPERPIXEL(native),
+                         format, *pixels,
+                         PSP_WIDTH * SDL_BYTESPERPIXEL(format)) < 0)
+   {
+      puts(SDL_GetError());
+      return false;
+   }
+
+   block->converted[block->conversions++].format = format;
+   return true;
+}
+
+/* Validates the header and makes every pixel format the views and the
+ * consumer need, so the block is read-only from here on. */
+static bool decode_frame(struct frame_block *block)
 {
-   struct JoyScrHeader *header = (struct JoyScrHeader *)block;
-   printf("Buff mode: %u\n", le32(header->mode));
-   printf("VCount: %d\n", le32(header->ref));
-   printf("Size: %d\n", le32(header->size));
+   struct JoyScrHeader *header = (struct JoyScrHeader *)block->data;
 
-   //memcpy(g_frame, block + sizeof(*header), le32(header->size));
    int32_t mode = (header->mode >> 4) & 0x0f;
 
    if (mode < 0 || mode > 3)
    {
       printf("Unknown header mode %d.\n", mode);
-      return;
+      return false;
    }
 
    int32_t size = le32(header->size);
@@ -230,30 +987,152 @@ static void process_bulk(const uint8_t *block)
    if (size > PSP_WIDTH * PSP_HEIGHT)
    {
       printf("Too big header size %d.\n", size);
-      return;
+      return false;
    }
 
-   SDL_Texture *frame = frames[mode];
-   int pitch;
-   void *pixels;
+   block->mode = mode;
+   hud.mode = mode;
+
+   for (unsigned v = 0; v < view_count; v++)
+      if (views[v].window)
+         convert_frame(block, views[v].formats[mode]);
+
+   if (dump.thread)
+      convert_frame(block, dump.format);
+
+   return true;
+}
+
+static bool draw_frame(struct view *view, const struct frame_block *block, double now)
+{
+   uint32_t format = view->formats[block->mode];
+   const uint8_t *pixels = frame_pixels(block, format);
+   SDL_Texture *frame;
 
-   if (SDL_LockTexture(frame, NULL, &pixels, &pitch) < 0)
+   if (!pixels || !(frame = acquire_texture(view, block->mode, now)))
+      return false;
+
+   if (SDL_UpdateTexture(frame, NULL, pixels, PSP_WIDTH * SDL_BYTESPERPIXEL(format)) < 0)
+   {
       puts(SDL_GetError());
+      return false;
+   }
 
-   memcpy(pixels, block + sizeof(*header), size);
-   SDL_UnlockTexture(frame);
+   if(SDL_RenderCopy(view->renderer, frame, NULL, NULL) < 0)
+      puts(SDL_GetError());
 
-   if(SDL_RenderCopy(renderer, frame, NULL, NULL) < 0)
+   return true;
+}
+
+static int consumer_thread(void *data)
+{
+   struct consumer *c = data;
+   size_t size = PSP_WIDTH * PSP_HEIGHT * SDL_BYTESPERPIXEL(c->format);
+
+   for (;;)
+   {
+      struct frame_block *block;
+
+      SDL_LockMutex(c->lock);
+      while (!c->pending && !c->die)
+         SDL_CondWait(c->cond, c->lock);
+      block = c->pending;
+      c->pending = NULL;
+      SDL_UnlockMutex(c->lock);
+
+      if (!block)
+         break;
+
+      const uint8_t *pixels = frame_pixels(block, c->format);
+      bool ok = !pixels || fwrite(pixels, 1, size, c->file) == size;
+      frame_put(block);
+
+      if (!ok)
+      {
+         printf("Writing frames to %s failed, stopping.\n", c->path);
+         break;
+      }
+   }
+
+   return 0;
+}
+
+static bool consumer_start(struct consumer *c)
+{
+   c->file = fopen(c->path, "wb");
+   if (!c->file)
+   {
+      printf("Failed to open %s.\n", c->path);
+      return false;
+   }
+
+   c->lock = SDL_CreateMutex();
+   c->cond = SDL_CreateCond();
+   c->die = false;
+
+   if (c->lock && c->cond)
+      c->thread = SDL_CreateThread(consumer_thread, "rjl-consumer", c);
+
+   if (!c->thread)
+   {
       puts(SDL_GetError());
+      return false;
+   }
 
-   SDL_RenderPresent(renderer);
+   return true;
 }
 
-#define HOSTFS_MAX_BLOCK (1024 * 1024)
-static bool handle_bulk(libusb_device_handle *dev, uint8_t *data, size_t size)
+static void consumer_push(struct consumer *c, struct frame_block *block)
+{
+   struct frame_block *old;
+
+   if (!c->thread)
+      return;
+
+   frame_get(block);
+
+   SDL_LockMutex(c->lock);
+   old = c->pending;
+   c->pending = block;
+   SDL_CondSignal(c->cond);
+   SDL_UnlockMutex(c->lock);
+
+   if (old)
+   {
+      c->dropped++;
+      frame_put(old);
+   }
+}
+
+static void consumer_stop(struct consumer *c)
 {
-   static uint8_t bulk_block[HOSTFS_MAX_BLOCK];
+   if (c->thread)
+   {
+      SDL_LockMutex(c->lock);
+      c->die = true;
+      SDL_CondSignal(c->cond);
+      SDL_UnlockMutex(c->lock);
+
+      SDL_WaitThread(c->thread, NULL);
+      c->thread = NULL;
+   }
+
+   if (c->pending)
+      frame_put(c->pending);
+   c->pending = NULL;
 
+   SDL_DestroyCond(c->cond);
+   c->cond = NULL;
+   SDL_DestroyMutex(c->lock);
+   c->lock = NULL;
+
+   if (c->file)
+      fclose(c->file);
+   c->file = NULL;
+}
+
+static bool handle_bulk(libusb_device_handle *dev, uint8_t *data, size_t size)
+{
    if (size < sizeof(struct BulkCommand))
       return false;
 
@@ -262,15 +1141,19 @@ static bool handle_bulk(libusb_device_handle *dev, uint8_t *data, size_t size)
    size_t data_size = le32(cmd->size);
    //printf("Data size: %zu\n", data_size);
 
+   if (data_size > HOSTFS_MAX_BLOCK)
+   {
+      printf("Too big bulk size %zu.\n", data_size);
+      return false;
+   }
+
    while (read_size < data_size)
    {
       size_t to_read = data_size - read_size;
-      if (to_read > HOSTFS_MAX_BLOCK)
-         to_read = HOSTFS_MAX_BLOCK;
 
       int transferred = 0;
       int ret = libusb_bulk_transfer(dev, 0x01 | LIBUSB_ENDPOINT_IN,
-                                     bulk_block + read_size, to_read, &transferred, 3000);
+                                     frame_back->data + read_size, to_read, &transferred, 3000);
 
       if (ret < 0)
          return false;
@@ -278,7 +1161,7 @@ static bool handle_bulk(libusb_device_handle *dev, uint8_t *data, size_t size)
       read_size += transferred;
    }
 
-   process_bulk(bulk_block);
+   publish_frame(data_size);
    return true;
 }
 
@@ -309,12 +1192,14 @@ error:
    return -1;
 }
 
-static void bulk_thread(void *dummy)
+static int bulk_thread(void *dummy)
 {
    (void)dummy;
 
    uint8_t buffer[512];
 
+   apply_thread_opts(&usb_opts, "USB");
+
    usb_check_device();
 
    bool active = false;
@@ -325,7 +1210,7 @@ static void bulk_thread(void *dummy)
       if (active)
       {
          if (!send_event(TYPE_JOY_DAT, 0, 0))
-            return;
+            goto error;
       }
 
       int transferred = 0;
@@ -373,23 +1258,27 @@ static void bulk_thread(void *dummy)
       }
    }
 
-   return;
+   return 0;
 error:
    g_thread_failed = true;
+   return -1;
 }
 
 void deinit(void)
 {
-   /* TODO:
    if (g_thread)
    {
       g_thread_die = true;
-      sthread_join(g_thread);
+      SDL_WaitThread(g_thread, NULL);
       g_thread = NULL;
       g_thread_die = false;
       g_thread_failed = false;
    }
-   */
+
+#ifndef __WIN32__
+   if (lock_memory)
+      munlock(frame_blocks, sizeof(frame_blocks));
+#endif
 
    if (device)
    {
@@ -405,37 +1294,43 @@ void deinit(void)
       context = NULL;
    }
 
-   // TODO: check for nulls
-   for (int32_t mode = 0; mode < 4; mode++)
-      if (frames[mode])
-         SDL_DestroyTexture(frames[mode]);
+   consumer_stop(&dump);
+
+   hud_deinit();
+   for (unsigned v = 0; v < view_count; v++)
+      view_close(&views[v]);
+
+   frame_pool_deinit();
+
+   SDL_DestroyCond(frame_cond);
+   frame_cond = NULL;
+   SDL_DestroyMutex(frame_lock);
+   frame_lock = NULL;
 
-   SDL_DestroyRenderer(renderer);
-   SDL_DestroyWindow(window);
    SDL_Quit();
 }
 
 bool init(void)
 {
+   /* tried in order, the original remote first */
+   static const struct libusb_device_id remote_ids[] = {
+      { SONY_VID, REMOTE_PID },
+      { SONY_VID, REMOTE_PID2 },
+   };
+
    if (libusb_init(&context) < 0)
    {
       puts("libusb_init failed.");
       goto error;
    }
 
-   device = libusb_open_device_with_vid_pid(context, SONY_VID, REMOTE_PID);
+   device = libusb_open_device_with_ids(context, remote_ids,
+         sizeof(remote_ids) / sizeof(remote_ids[0]));
 
    if (!device)
    {
-      puts("libusb_open_device_with_vid_pid failed, trying attempt 2...");
-
-      device = libusb_open_device_with_vid_pid(context, SONY_VID, REMOTE_PID2);
-
-      if (!device)
-      {
-         puts("libusb_open_device_with_vid_pid attempt 2 failed...");
-         goto error;
-      }
+      puts("libusb_open_device_with_ids failed.");
+      goto error;
    }
 
    if (libusb_kernel_driver_active(device, 0))
@@ -461,43 +1356,42 @@ bool init(void)
       goto error;
    }
 
-   // TODO: check for errors
-   for (int32_t mode = 0; mode < 4; mode++)
-      frames[mode] = SDL_CreateTexture(
-          renderer,
-          formats[mode],
-          SDL_TEXTUREACCESS_STREAMING,
-          PSP_WIDTH,
-          PSP_HEIGHT);
-
    g_thread_failed = false;
    g_thread_die = false;
 
-   /* TODO:
-   g_thread = sthread_create(bulk_thread, NULL);
-   if (!g_thread)
-      goto error;
-   */
+#ifndef __WIN32__
+   /* Keep the frame blocks resident so a page fault never stalls the USB
+    * thread in the middle of a transfer. */
+   if (lock_memory && mlock(frame_blocks, sizeof(frame_blocks)) < 0)
+   {
+      puts("mlock failed, continuing without locked frame buffers.");
+      lock_memory = false;
+   }
+#endif
 
    SDL_Init(SDL_INIT_VIDEO);
 
-   window = SDL_CreateWindow(
-       "RJL-Client",
-       SDL_WINDOWPOS_UNDEFINED,
-       SDL_WINDOWPOS_UNDEFINED,
-       PSP_WIDTH,
-       PSP_HEIGHT,
-       SDL_WINDOW_BORDERLESS);
+   frame_lock = SDL_CreateMutex();
+   frame_cond = SDL_CreateCond();
 
-   if (window == NULL)
+   if (!frame_lock || !frame_cond)
    {
       puts(SDL_GetError());
       goto error;
    }
 
-   renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+   frame_pool_init();
+
+   for (unsigned v = 0; v < view_count; v++)
+      if (!view_open(&views[v], v == 0))
+         goto error;
+
+   if (dump.path && !consumer_start(&dump))
+      goto error;
+
+   g_thread = SDL_CreateThread(bulk_thread, "rjl-usb", NULL);
 
-   if (renderer == NULL)
+   if (g_thread == NULL)
    {
       puts(SDL_GetError());
       goto error;
@@ -509,27 +1403,216 @@ error:
    return false;
 }
 
-int main(void)
+static void present_frame(const struct frame_block *block)
 {
-   init();
-   SDL_Delay(3000);
-   deinit();
-   return 0;
+   double now = now_seconds();
+
+   hud_prepare();
+
+   for (unsigned v = 0; v < view_count; v++)
+   {
+      struct view *view = &views[v];
+
+      if (!view->window || !draw_frame(view, block, now))
+         continue;
+
+      if (v == 0)
+         hud_draw();
+
+      SDL_RenderPresent(view->renderer);
+
+      if (v == 0)
+      {
+         pacer_presented(&pacer);
+         hud_record_present(block->arrival);
+      }
+   }
 }
 
-void run_program(void)
+static bool run_program(void)
 {
-   /* TODO:
+   SDL_Event event;
+
+   while (SDL_PollEvent(&event))
+   {
+      if (event.type == SDL_QUIT)
+         return false;
+      if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
+         return false;
+      if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F1 && !event.key.repeat)
+      {
+         hud.visible = !hud.visible;
+         hud.dirty = true;
+      }
+      if (event.type == SDL_RENDER_TARGETS_RESET && hud.atlas)
+         hud_build_atlas();
+      if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE)
+      {
+         /* Closing the main window quits, any other one just goes away. */
+         if (event.window.windowID == SDL_GetWindowID(views[0].window))
+            return false;
+
+         for (unsigned v = 1; v < view_count; v++)
+            if (views[v].window && event.window.windowID == SDL_GetWindowID(views[v].window))
+               view_close(&views[v]);
+      }
+   }
+
    if (g_thread_failed)
-      environ_cb(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
-   */
+      return false;
 
-   // TODO: Employ a more "sane" scheme using conditional variables, etc.
-   // slock_lock(g_lock);
-   // memcpy(g_frame_buffer, g_frame, sizeof(g_frame));
-   // slock_unlock(g_lock);
+   if (!wait_frame(100))
+   {
+      /* Idle textures still have to go once frames stop coming in. */
+      release_idle_textures(now_seconds());
+      return true;
+   }
+
+   for (;;)
+   {
+      const struct JoyScrHeader *header = (const struct JoyScrHeader *)frame_front->data;
+
+      if (decode_frame(frame_front))
+         consumer_push(&dump, frame_front);
+
+      double target = pacer_schedule(&pacer, le32(header->ref), frame_front->arrival);
+
+      if (!pacer.drop_late)
+      {
+         sleep_until(target);
+         break;
+      }
+
+      /* Rather than queueing, let a newer frame replace one still waiting
+       * for its slot. */
+      if (!wait_frame_until(target))
+         break;
+
+      pacer.dropped++;
+   }
+
+   if (frame_front->mode >= 0)
+      present_frame(frame_front);
+
+   release_idle_textures(now_seconds());
 
-   // video_cb(g_frame_buffer, PSP_WIDTH, PSP_HEIGHT, PSP_WIDTH * sizeof(uint32_t));
    // No audio :(
    // TODO: Poll input here.
+   return true;
+}
+
+static int parse_priority(const char *name)
+{
+   if (strcmp(name, "low") == 0)
+      return SDL_THREAD_PRIORITY_LOW;
+   if (strcmp(name, "normal") == 0)
+      return SDL_THREAD_PRIORITY_NORMAL;
+   if (strcmp(name, "high") == 0)
+      return SDL_THREAD_PRIORITY_HIGH;
+   if (strcmp(name, "critical") == 0)
+      return SDL_THREAD_PRIORITY_TIME_CRITICAL;
+   return -1;
+}
+
+static void usage(const char *prog)
+{
+   printf("Usage: %s [options]\n"
+          "  --usb-cpu=N            pin the USB thread to CPU N\n"
+          "  --render-cpu=N         pin the render thread to CPU N\n"
+          "  --usb-priority=P       low, normal, high or critical\n"
+          "  --render-priority=P    low, normal, high or critical\n"
+          "  --sched=POLICY         current, other, rr or fifo\n"
+          "  --mlock                lock the frame buffers in memory\n"
+          "  --pacing=on|off        present on a vsync-aligned schedule (default on)\n"
+          "  --present-phase=F      submit F refreshes ahead of vblank (default 0.25)\n"
+          "  --latency-budget=MS    hold a frame back at most MS ms (default 1 refresh)\n"
+          "  --drop-late            drop frames overtaken by a newer one\n"
+          "  --hud                  start with the statistics overlay (F1 toggles)\n"
+          "  --view=SCALE           open another window at SCALE times PSP size\n"
+          "  --dump=PATH            write raw ARGB8888 frames to PATH (file or pipe)\n",
+          prog);
+}
+
+static bool parse_args(int argc, char **argv)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      const char *val = strchr(arg, '=');
+      size_t len = val ? (size_t)(val - arg) : strlen(arg);
+      int *priority = NULL;
+
+      if (val)
+         val++;
+
+      if (len == 9 && strncmp(arg, "--usb-cpu", len) == 0 && val)
+         usb_opts.cpu = atoi(val);
+      else if (len == 12 && strncmp(arg, "--render-cpu", len) == 0 && val)
+         render_opts.cpu = atoi(val);
+      else if (len == 14 && strncmp(arg, "--usb-priority", len) == 0 && val)
+         priority = &usb_opts.priority;
+      else if (len == 17 && strncmp(arg, "--render-priority", len) == 0 && val)
+         priority = &render_opts.priority;
+      else if (len == 7 && strncmp(arg, "--sched", len) == 0 && val)
+         SDL_SetHint(SDL_HINT_THREAD_PRIORITY_POLICY, val);
+      else if (strcmp(arg, "--mlock") == 0)
+         lock_memory = true;
+      else if (len == 8 && strncmp(arg, "--pacing", len) == 0 && val)
+         pacer.enabled = strcmp(val, "off") != 0;
+      else if (len == 15 && strncmp(arg, "--present-phase", len) == 0 && val)
+         pacer.phase = SDL_atof(val);
+      else if (len == 16 && strncmp(arg, "--latency-budget", len) == 0 && val)
+         pacer.budget = SDL_atof(val) / 1000.0;
+      else if (strcmp(arg, "--drop-late") == 0)
+         pacer.drop_late = true;
+      else if (strcmp(arg, "--hud") == 0)
+         hud.visible = true;
+      else if (len == 6 && strncmp(arg, "--view", len) == 0 && val)
+      {
+         if (view_count == MAX_VIEWS)
+         {
+            printf("At most %d views are supported.\n", MAX_VIEWS);
+            return false;
+         }
+
+         views[view_count].scale = atoi(val);
+         if (views[view_count].scale < 1)
+            views[view_count].scale = 1;
+         view_count++;
+      }
+      else if (len == 6 && strncmp(arg, "--dump", len) == 0 && val)
+         dump.path = val;
+      else
+      {
+         usage(argv[0]);
+         return false;
+      }
+
+      if (priority && (*priority = parse_priority(val)) < 0)
+      {
+         printf("Unknown thread priority \"%s\".\n", val);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+int main(int argc, char **argv)
+{
+   if (!parse_args(argc, argv))
+      return 1;
+
+   if (!init())
+      return 1;
+
+   apply_thread_opts(&render_opts, "render");
+   pacer_init(&pacer, views[0].window);
+   hud_init(views[0].renderer);
+
+   while (run_program())
+      ;
+
+   deinit();
+   return 0;
 }